@@ -0,0 +1,359 @@
+#include <pthread.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <netdb.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <mongo.h>
+#include "mongo-fuse.h"
+
+/*
+ * Pipelined queries. The driver's calls each hold a connection for a full
+ * round trip, so a thread can only ever have one request outstanding.
+ * This keeps its own small set of connections and speaks the wire
+ * protocol directly: any number of threads can send queries down a
+ * connection without waiting for earlier replies, and a reader thread
+ * per connection matches replies back to requests by their responseTo.
+ * A caller can have dozens of queries in flight at once and then collect
+ * the replies, which is what hides the latency of a distant server.
+ *
+ * Only queries go through here, and only the first batch of results is
+ * returned, so callers ask for a single batch and must cope with getting
+ * fewer documents than they asked for.
+ */
+
+#define OP_REPLY 1
+#define OP_QUERY 2004
+#define REPLY_QUERY_FAILURE 2
+#define MSG_HEADER_LEN 16
+#define REPLY_HEADER_LEN (MSG_HEADER_LEN + 20)
+#define MAX_MESSAGE_LEN (48 << 20)
+
+#ifndef MSG_NOSIGNAL
+#define MSG_NOSIGNAL 0
+#endif
+
+struct aio_conn {
+    pthread_mutex_t lock;
+    pthread_cond_t cond;
+    int fd;
+    struct aio_req * pending;
+};
+
+struct aio_req {
+    struct aio_req * next;
+    struct aio_conn * conn;
+    int32_t id;
+    int done;
+    int err;
+    char * reply;
+    size_t replylen;
+};
+
+struct reader_arg {
+    struct aio_conn * conn;
+    int fd;
+};
+
+static struct aio_conn * conns = NULL;
+static int nconns = 0;
+static unsigned int next_conn = 0;
+static int32_t next_id = 0;
+
+extern mongo_host_port dbhost;
+
+static void put_int32(char * p, int32_t v) {
+    p[0] = v & 0xff;
+    p[1] = (v >> 8) & 0xff;
+    p[2] = (v >> 16) & 0xff;
+    p[3] = (v >> 24) & 0xff;
+}
+
+static int32_t get_int32(const char * p) {
+    const uint8_t * u = (const uint8_t*)p;
+    return (int32_t)(u[0] | (u[1] << 8) | (u[2] << 16) | ((uint32_t)u[3] << 24));
+}
+
+void setup_aio(int count) {
+    int i;
+
+    if(count <= 0)
+        return;
+    if((conns = calloc(count, sizeof(struct aio_conn))) == NULL) {
+        fprintf(stderr, "Error allocating pipelined connections\n");
+        return;
+    }
+    for(i = 0; i < count; i++) {
+        pthread_mutex_init(&conns[i].lock, NULL);
+        pthread_cond_init(&conns[i].cond, NULL);
+        conns[i].fd = -1;
+    }
+    nconns = count;
+}
+
+int aio_enabled() {
+    return nconns > 0;
+}
+
+static int read_full(int fd, char * buf, size_t len) {
+    ssize_t n;
+    while(len > 0) {
+        if((n = read(fd, buf, len)) <= 0) {
+            if(n < 0 && errno == EINTR)
+                continue;
+            return -EIO;
+        }
+        buf += n;
+        len -= n;
+    }
+    return 0;
+}
+
+static int write_full(int fd, const char * buf, size_t len) {
+    ssize_t n;
+    while(len > 0) {
+        if((n = send(fd, buf, len, MSG_NOSIGNAL)) < 0) {
+            if(errno == EINTR)
+                continue;
+            return -EIO;
+        }
+        buf += n;
+        len -= n;
+    }
+    return 0;
+}
+
+/* Fails everything waiting on fd. Must be called with conn->lock held. */
+static void fail_conn(struct aio_conn * conn, int fd) {
+    struct aio_req * req;
+
+    if(conn->fd != fd)
+        return;
+    close(fd);
+    conn->fd = -1;
+    while((req = conn->pending) != NULL) {
+        conn->pending = req->next;
+        req->err = -EIO;
+        req->done = 1;
+    }
+    pthread_cond_broadcast(&conn->cond);
+}
+
+static void * reader_thread(void * p) {
+    struct reader_arg * arg = p;
+    struct aio_conn * conn = arg->conn;
+    int fd = arg->fd;
+    char header[MSG_HEADER_LEN], * body;
+    int32_t len, responseto;
+    struct aio_req ** preq, * req;
+
+    free(arg);
+    for(;;) {
+        if(read_full(fd, header, MSG_HEADER_LEN) != 0)
+            break;
+        len = get_int32(header);
+        responseto = get_int32(header + 8);
+        if(len < REPLY_HEADER_LEN || len > MAX_MESSAGE_LEN ||
+            get_int32(header + 12) != OP_REPLY)
+            break;
+        if((body = malloc(len - MSG_HEADER_LEN)) == NULL)
+            break;
+        if(read_full(fd, body, len - MSG_HEADER_LEN) != 0) {
+            free(body);
+            break;
+        }
+
+        pthread_mutex_lock(&conn->lock);
+        preq = &conn->pending;
+        while(*preq && (*preq)->id != responseto)
+            preq = &(*preq)->next;
+        if((req = *preq) != NULL) {
+            *preq = req->next;
+            req->reply = body;
+            req->replylen = len - MSG_HEADER_LEN;
+            req->done = 1;
+            pthread_cond_broadcast(&conn->cond);
+        } else
+            free(body);
+        pthread_mutex_unlock(&conn->lock);
+    }
+
+    pthread_mutex_lock(&conn->lock);
+    fail_conn(conn, fd);
+    pthread_mutex_unlock(&conn->lock);
+    return NULL;
+}
+
+/* Must be called with conn->lock held. */
+static int open_conn(struct aio_conn * conn) {
+    struct addrinfo hints, * addrs, * a;
+    struct reader_arg * arg;
+    pthread_t thread;
+    char port[16];
+    int fd = -1, one = 1;
+
+    memset(&hints, 0, sizeof(hints));
+    hints.ai_family = AF_UNSPEC;
+    hints.ai_socktype = SOCK_STREAM;
+    snprintf(port, sizeof(port), "%d", dbhost.port);
+    if(getaddrinfo(dbhost.host, port, &hints, &addrs) != 0) {
+        fprintf(stderr, "Error resolving %s for pipelined connection\n",
+            dbhost.host);
+        return -EIO;
+    }
+    for(a = addrs; a; a = a->ai_next) {
+        if((fd = socket(a->ai_family, a->ai_socktype, a->ai_protocol)) < 0)
+            continue;
+        if(connect(fd, a->ai_addr, a->ai_addrlen) == 0)
+            break;
+        close(fd);
+        fd = -1;
+    }
+    freeaddrinfo(addrs);
+    if(fd < 0) {
+        fprintf(stderr, "Error opening pipelined connection to %s:%d\n",
+            dbhost.host, dbhost.port);
+        return -EIO;
+    }
+
+    setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+#ifdef SO_NOSIGPIPE
+    setsockopt(fd, SOL_SOCKET, SO_NOSIGPIPE, &one, sizeof(one));
+#endif
+
+    if((arg = malloc(sizeof(struct reader_arg))) == NULL) {
+        close(fd);
+        return -ENOMEM;
+    }
+    arg->conn = conn;
+    arg->fd = fd;
+    if(pthread_create(&thread, NULL, reader_thread, arg) != 0) {
+        fprintf(stderr, "Error starting pipelined reader thread\n");
+        free(arg);
+        close(fd);
+        return -EIO;
+    }
+    pthread_detach(thread);
+    conn->fd = fd;
+    return 0;
+}
+
+/*
+ * Sends a query and returns without waiting for the reply; collect it
+ * with aio_wait. nreturn is passed through as numberToReturn, so a
+ * negative number asks for a single batch and no cursor. Returns NULL
+ * if the query couldn't be sent.
+ */
+struct aio_req * aio_query(const char * ns, const bson * query,
+    const bson * fields, int nreturn) {
+    struct aio_conn * conn;
+    struct aio_req * req;
+    size_t nslen = strlen(ns) + 1, len;
+    char * msg, * p;
+    int fd, res;
+
+    if(nconns == 0)
+        return NULL;
+
+    len = MSG_HEADER_LEN + 4 + nslen + 8 + bson_size(query) +
+        (fields ? bson_size(fields) : 0);
+    if((msg = malloc(len)) == NULL)
+        return NULL;
+    if((req = calloc(1, sizeof(struct aio_req))) == NULL) {
+        free(msg);
+        return NULL;
+    }
+    req->id = __sync_add_and_fetch(&next_id, 1);
+
+    put_int32(msg, len);
+    put_int32(msg + 4, req->id);
+    put_int32(msg + 8, 0);
+    put_int32(msg + 12, OP_QUERY);
+    p = msg + MSG_HEADER_LEN;
+    put_int32(p, 0);
+    memcpy(p + 4, ns, nslen);
+    p += 4 + nslen;
+    put_int32(p, 0);
+    put_int32(p + 4, nreturn);
+    p += 8;
+    memcpy(p, bson_data(query), bson_size(query));
+    if(fields)
+        memcpy(p + bson_size(query), bson_data(fields), bson_size(fields));
+
+    conn = &conns[__sync_fetch_and_add(&next_conn, 1) % nconns];
+    req->conn = conn;
+
+    // Sends are serialized per connection so messages don't interleave,
+    // but nobody waits here for a reply.
+    pthread_mutex_lock(&conn->lock);
+    if(conn->fd < 0 && open_conn(conn) != 0) {
+        pthread_mutex_unlock(&conn->lock);
+        free(msg);
+        free(req);
+        return NULL;
+    }
+    fd = conn->fd;
+    req->next = conn->pending;
+    conn->pending = req;
+    if((res = write_full(fd, msg, len)) != 0) {
+        // The reader sees the shutdown and fails everything pending,
+        // including this request.
+        shutdown(fd, SHUT_RDWR);
+    }
+    pthread_mutex_unlock(&conn->lock);
+    free(msg);
+    return req;
+}
+
+/*
+ * Waits for the reply to req, calls cb on each document in it and frees
+ * req. Returns 0, an error from the connection or the query, or the
+ * first non-zero value returned by cb.
+ */
+int aio_wait(struct aio_req * req,
+    int (*cb)(const bson * doc, void * p), void * p) {
+    struct aio_conn * conn = req->conn;
+    const char * doc, * end;
+    int32_t flags, nreturned, doclen;
+    bson b;
+    int res;
+
+    pthread_mutex_lock(&conn->lock);
+    while(!req->done)
+        pthread_cond_wait(&conn->cond, &conn->lock);
+    pthread_mutex_unlock(&conn->lock);
+
+    if((res = req->err) != 0)
+        goto end;
+
+    flags = get_int32(req->reply);
+    nreturned = get_int32(req->reply + 16);
+    doc = req->reply + 20;
+    end = req->reply + req->replylen;
+    if(flags & REPLY_QUERY_FAILURE) {
+        fprintf(stderr, "Pipelined query failed\n");
+        res = -EIO;
+        goto end;
+    }
+
+    while(nreturned-- > 0 && end - doc >= 5) {
+        doclen = get_int32(doc);
+        if(doclen < 5 || doclen > end - doc) {
+            res = -EIO;
+            break;
+        }
+        bson_init_finished_data(&b, (char*)doc, 0);
+        if((res = cb(&b, p)) != 0)
+            break;
+        doc += doclen;
+    }
+end:
+    if(req->reply)
+        free(req->reply);
+    free(req);
+    return res;
+}
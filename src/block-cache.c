@@ -0,0 +1,230 @@
+#include <pthread.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <mongo.h>
+#include "mongo-fuse.h"
+
+/*
+ * Process-wide cache of decompressed blocks keyed by their hash. Blocks
+ * are immutable once written, so entries never need to be invalidated,
+ * only evicted. The cache is split into shards, each with its own lock,
+ * hash table and LRU list, so FUSE worker threads reading different
+ * blocks don't serialize on a single mutex.
+ */
+
+#define BLOCK_CACHE_SHARDS 64
+
+struct cache_block {
+    struct cache_block * hnext;
+    struct cache_block * lru_prev;
+    struct cache_block * lru_next;
+    size_t len;
+    uint8_t hash[HASH_LEN];
+    char data[1];
+};
+
+struct cache_shard {
+    pthread_mutex_t lock;
+    struct cache_block ** buckets;
+    uint32_t nbuckets;
+    struct cache_block * lru_head;
+    struct cache_block * lru_tail;
+    size_t used;
+    size_t limit;
+};
+
+static struct cache_shard shards[BLOCK_CACHE_SHARDS];
+static int cache_enabled = 0;
+
+static uint32_t hash_word(const uint8_t hash[HASH_LEN]) {
+    uint32_t out;
+    // The hash is already uniformly distributed, so any four bytes of it
+    // that aren't used to pick the shard make a fine bucket index.
+    memcpy(&out, hash + 1, sizeof(out));
+    return out;
+}
+
+static struct cache_shard * get_shard(const uint8_t hash[HASH_LEN]) {
+    return &shards[hash[0] % BLOCK_CACHE_SHARDS];
+}
+
+void setup_block_cache(size_t megabytes) {
+    size_t limit = (megabytes << 20) / BLOCK_CACHE_SHARDS;
+    uint32_t nbuckets = 16;
+    int i;
+
+    if(limit == 0)
+        return;
+
+    while(nbuckets < limit / 8192)
+        nbuckets <<= 1;
+
+    for(i = 0; i < BLOCK_CACHE_SHARDS; i++) {
+        struct cache_shard * s = &shards[i];
+        pthread_mutex_init(&s->lock, NULL);
+        s->buckets = calloc(nbuckets, sizeof(struct cache_block*));
+        if(!s->buckets) {
+            fprintf(stderr, "Error allocating block cache\n");
+            return;
+        }
+        s->nbuckets = nbuckets;
+        s->limit = limit;
+    }
+    cache_enabled = 1;
+}
+
+static void lru_unlink(struct cache_shard * s, struct cache_block * b) {
+    if(b->lru_prev)
+        b->lru_prev->lru_next = b->lru_next;
+    else
+        s->lru_head = b->lru_next;
+    if(b->lru_next)
+        b->lru_next->lru_prev = b->lru_prev;
+    else
+        s->lru_tail = b->lru_prev;
+    b->lru_prev = b->lru_next = NULL;
+}
+
+static void lru_push(struct cache_shard * s, struct cache_block * b) {
+    b->lru_prev = NULL;
+    b->lru_next = s->lru_head;
+    if(s->lru_head)
+        s->lru_head->lru_prev = b;
+    s->lru_head = b;
+    if(!s->lru_tail)
+        s->lru_tail = b;
+}
+
+static struct cache_block ** find_slot(struct cache_shard * s,
+    const uint8_t hash[HASH_LEN]) {
+    struct cache_block ** slot =
+        &s->buckets[hash_word(hash) & (s->nbuckets - 1)];
+    while(*slot && memcmp((*slot)->hash, hash, HASH_LEN) != 0)
+        slot = &(*slot)->hnext;
+    return slot;
+}
+
+static void evict_one(struct cache_shard * s) {
+    struct cache_block * victim = s->lru_tail;
+    struct cache_block ** slot = find_slot(s, victim->hash);
+
+    *slot = victim->hnext;
+    lru_unlink(s, victim);
+    s->used -= victim->len;
+    free(victim);
+}
+
+/* Must be called with the shard locked. */
+static struct cache_block * lookup(struct cache_shard * s,
+    const uint8_t hash[HASH_LEN]) {
+    struct cache_block * b = *find_slot(s, hash);
+    if(b && s->lru_head != b) {
+        lru_unlink(s, b);
+        lru_push(s, b);
+    }
+    return b;
+}
+
+/*
+ * Copies len bytes from off in the cached block straight into buf, so
+ * reads only copy the part of a block they need.
+ */
+int block_cache_read(const uint8_t hash[HASH_LEN], size_t off, size_t len,
+    char * buf) {
+    struct cache_shard * s;
+    struct cache_block * b;
+    int res = 0;
+
+    if(!cache_enabled)
+        return -ENOENT;
+
+    s = get_shard(hash);
+    pthread_mutex_lock(&s->lock);
+    if(!(b = lookup(s, hash)))
+        res = -ENOENT;
+    else if(off + len > b->len)
+        res = -EIO;
+    else
+        memcpy(buf, b->data + off, len);
+    pthread_mutex_unlock(&s->lock);
+    return res;
+}
+
+/* Returns a malloc'd copy of the whole cached block in *out. */
+int block_cache_dup(const uint8_t hash[HASH_LEN], char ** out, size_t * len) {
+    struct cache_shard * s;
+    struct cache_block * b;
+    int res = 0;
+
+    if(!cache_enabled)
+        return -ENOENT;
+
+    s = get_shard(hash);
+    pthread_mutex_lock(&s->lock);
+    if(!(b = lookup(s, hash)))
+        res = -ENOENT;
+    else if((*out = malloc(b->len)) == NULL)
+        res = -ENOMEM;
+    else {
+        memcpy(*out, b->data, b->len);
+        *len = b->len;
+    }
+    pthread_mutex_unlock(&s->lock);
+    return res;
+}
+
+int block_cache_has(const uint8_t hash[HASH_LEN]) {
+    struct cache_shard * s;
+    int res;
+
+    if(!cache_enabled)
+        return 0;
+
+    s = get_shard(hash);
+    pthread_mutex_lock(&s->lock);
+    res = *find_slot(s, hash) != NULL;
+    pthread_mutex_unlock(&s->lock);
+    return res;
+}
+
+void block_cache_put(const uint8_t hash[HASH_LEN], const char * buf, size_t len) {
+    struct cache_shard * s;
+    struct cache_block * b, ** slot;
+
+    if(!cache_enabled)
+        return;
+
+    s = get_shard(hash);
+    if(len > s->limit)
+        return;
+
+    // Allocate and copy outside the lock; we only need it to link the
+    // block into the shard.
+    b = malloc(sizeof(struct cache_block) + len);
+    if(!b)
+        return;
+    memcpy(b->hash, hash, HASH_LEN);
+    memcpy(b->data, buf, len);
+    b->len = len;
+
+    pthread_mutex_lock(&s->lock);
+    slot = find_slot(s, hash);
+    if(*slot) {
+        // Another thread already cached this block.
+        pthread_mutex_unlock(&s->lock);
+        free(b);
+        return;
+    }
+
+    while(s->used + len > s->limit && s->lru_tail)
+        evict_one(s);
+
+    // Eviction may have unlinked the chain we found the slot in.
+    slot = find_slot(s, hash);
+    b->hnext = NULL;
+    *slot = b;
+    lru_push(s, b);
+    s->used += len;
+    pthread_mutex_unlock(&s->lock);
+}
@@ -0,0 +1,278 @@
+#include <pthread.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <time.h>
+#include <unistd.h>
+#include <mongo.h>
+#include "mongo-fuse.h"
+
+/*
+ * Write staging. Instead of storing each buffer FUSE hands to mongo_write
+ * as its own block, contiguous writes are staged per open file and cut
+ * into blocks here, in one of two ways:
+ *
+ * - Coalescing (the default) just cuts max_block_size-aligned blocks, so
+ *   a stream of 4KB writes becomes one block, hash, compression and
+ *   extent entry per block rather than per write.
+ * - Content-defined chunking cuts blocks where a rolling Gear hash of the
+ *   data hits a boundary pattern, as in FastCDC. Inserting a few bytes
+ *   near the start of a file then only changes the blocks around the
+ *   insert rather than every block after it. Cut points are chosen
+ *   between a minimum and maximum size, using a harder boundary pattern
+ *   before the average size and an easier one after it so block sizes
+ *   cluster around the average.
+ *
+ * The staging buffer holds two maximum-sized blocks; blocks are only cut
+ * from it once a full maximum is buffered, so every cut sees as much data
+ * as it could have. Anything staged is written out by flush_stage when
+ * the file is flushed, read, truncated or written somewhere other than
+ * the end of the stage, and by a timer once it has gone STAGE_MAX_AGE
+ * seconds without a write. Files with staged data are kept on a list for the timer.
+ */
+
+#define STAGE_MAX_AGE 1
+
+static int chunking = STAGE_NONE;
+static pthread_mutex_t staged_lock = PTHREAD_MUTEX_INITIALIZER;
+static struct inode * staged_head = NULL;
+static size_t min_size, avg_size, max_size;
+static uint64_t mask_s, mask_l;
+static uint64_t gear[256];
+
+static uint64_t top_bits(int bits) {
+    // Only the high bits of the rolling hash depend on a full 64-byte
+    // window, so boundary patterns are matched against those.
+    return ~(uint64_t)0 << (64 - bits);
+}
+
+void setup_chunking(int mode, size_t avg) {
+    uint64_t x = 0x6d6f6e676f667573ULL;
+    int i, bits = 0;
+
+    chunking = mode;
+    max_size = max_block_size;
+    if(mode != STAGE_CDC)
+        return;
+
+    while(((size_t)2 << bits) <= avg)
+        bits++;
+    if(bits < 10)
+        bits = 10;
+    while(((size_t)1 << bits) > max_size / 2)
+        bits--;
+
+    avg_size = (size_t)1 << bits;
+    min_size = avg_size / 4;
+    mask_s = top_bits(bits + 2);
+    mask_l = top_bits(bits - 2);
+
+    // The table has to be the same on every mount or identical data would
+    // be cut differently, so it comes from a fixed-seed splitmix64.
+    for(i = 0; i < 256; i++) {
+        uint64_t z = (x += 0x9e3779b97f4a7c15ULL);
+        z = (z ^ (z >> 30)) * 0xbf58476d1ce4e5b9ULL;
+        z = (z ^ (z >> 27)) * 0x94d049bb133111ebULL;
+        gear[i] = z ^ (z >> 31);
+    }
+}
+
+static size_t find_cut(const uint8_t * p, size_t n, off_t off) {
+    size_t i = min_size, normal = avg_size;
+    uint64_t fp = 0;
+
+    // Fixed cuts line up with file offsets so that rewriting part of a
+    // file replaces whole blocks.
+    if(chunking != STAGE_CDC) {
+        i = max_size - off % max_size;
+        return n > i ? i : n;
+    }
+    if(n <= min_size)
+        return n;
+    if(n > max_size)
+        n = max_size;
+    if(normal > n)
+        normal = n;
+
+    for(; i < normal; i++) {
+        fp = (fp << 1) + gear[p[i]];
+        if(!(fp & mask_s))
+            return i + 1;
+    }
+    for(; i < n; i++) {
+        fp = (fp << 1) + gear[p[i]];
+        if(!(fp & mask_l))
+            return i + 1;
+    }
+    return n;
+}
+
+/* Must be called with stage_lock held. */
+static void set_staged(struct inode * e, int staged) {
+    if(e->staged == staged)
+        return;
+    pthread_mutex_lock(&staged_lock);
+    if(staged) {
+        e->stage_prev = NULL;
+        e->stage_next = staged_head;
+        if(staged_head)
+            staged_head->stage_prev = e;
+        staged_head = e;
+    } else {
+        if(e->stage_prev)
+            e->stage_prev->stage_next = e->stage_next;
+        else
+            staged_head = e->stage_next;
+        if(e->stage_next)
+            e->stage_next->stage_prev = e->stage_prev;
+    }
+    e->staged = staged;
+    pthread_mutex_unlock(&staged_lock);
+}
+
+/*
+ * Writes out blocks from the front of the stage. Unless all is set, this
+ * stops once less than a maximum-sized block is left. Must be called with
+ * stage_lock held and wr_lock not held.
+ */
+static int drain_stage(struct inode * e, int all) {
+    size_t done = 0, cut;
+    int res = 0;
+
+    while(e->stage_len - done >= (all ? 1 : max_size)) {
+        cut = find_cut((uint8_t*)e->stage + done, e->stage_len - done,
+            e->stage_off + done);
+        if((res = write_block(e, e->stage + done, cut,
+            e->stage_off + done)) != 0)
+            break;
+        done += cut;
+    }
+
+    if(done > 0) {
+        memmove(e->stage, e->stage + done, e->stage_len - done);
+        e->stage_len -= done;
+        e->stage_off += done;
+    }
+    set_staged(e, e->stage_len > 0);
+    return res;
+}
+
+int stage_write(struct inode * e, const char * buf, size_t size, off_t offset) {
+    size_t n;
+    int res = 0;
+
+    pthread_mutex_lock(&e->stage_lock);
+    if(e->stage_len > 0 && offset != e->stage_off + e->stage_len &&
+        (res = drain_stage(e, 1)) != 0)
+        goto end;
+
+    if(!e->stage && (e->stage = malloc(max_size * 2)) == NULL) {
+        res = -ENOMEM;
+        goto end;
+    }
+    if(e->stage_len == 0)
+        e->stage_off = offset;
+
+    while(size > 0) {
+        n = max_size * 2 - e->stage_len;
+        if(n > size)
+            n = size;
+        memcpy(e->stage + e->stage_len, buf, n);
+        e->stage_len += n;
+        buf += n;
+        size -= n;
+        if((res = drain_stage(e, 0)) != 0)
+            break;
+    }
+    // The timer only flushes stages that have gone idle.
+    e->stage_age = time(NULL);
+end:
+    pthread_mutex_unlock(&e->stage_lock);
+    return res;
+}
+
+/*
+ * Writes out anything staged that overlaps [off, end). Callers must not
+ * hold wr_lock, since storing blocks takes it.
+ */
+int flush_stage(struct inode * e, off_t off, off_t end) {
+    int res = 0;
+
+    if(chunking == STAGE_NONE)
+        return 0;
+
+    pthread_mutex_lock(&e->stage_lock);
+    if(e->stage_len > 0 && off < e->stage_off + (off_t)e->stage_len &&
+        end > e->stage_off)
+        res = drain_stage(e, 1);
+    pthread_mutex_unlock(&e->stage_lock);
+    return res;
+}
+
+/* Takes the inode off the timer's list before it's freed. */
+void drop_stage(struct inode * e) {
+    pthread_mutex_lock(&e->stage_lock);
+    set_staged(e, 0);
+    e->stage_len = 0;
+    pthread_mutex_unlock(&e->stage_lock);
+}
+
+static void * stage_timer_thread(void * arg) {
+    struct inode * e;
+    time_t now;
+    int res;
+
+    for(;;) {
+        sleep(STAGE_MAX_AGE);
+        now = time(NULL);
+
+        for(;;) {
+            // Only trylock stage_lock, since set_staged takes the locks in
+            // the other order; anything busy is being written to anyway.
+            pthread_mutex_lock(&staged_lock);
+            for(e = staged_head; e; e = e->stage_next) {
+                if(now - e->stage_age >= STAGE_MAX_AGE &&
+                    pthread_mutex_trylock(&e->stage_lock) == 0)
+                    break;
+            }
+            pthread_mutex_unlock(&staged_lock);
+            if(!e)
+                break;
+
+            // free_inode drops the stage before freeing anything else,
+            // and that takes stage_lock, so holding it keeps the inode
+            // from being freed under us.
+            if((res = drain_stage(e, 1)) == 0) {
+                pthread_mutex_lock(&e->wr_lock);
+                if((res = wait_blocks(e, 0)) == 0)
+                    res = serialize_stored(e);
+                if(res == 0)
+                    e->wr_age = now;
+                pthread_mutex_unlock(&e->wr_lock);
+            }
+            if(res != 0) {
+                fprintf(stderr, "Error flushing staged writes: %d\n", res);
+                // Try again next time rather than spinning on it.
+                e->stage_age = now;
+            }
+            pthread_mutex_unlock(&e->stage_lock);
+        }
+    }
+    return NULL;
+}
+
+void start_stage_timer() {
+    pthread_t thread;
+
+    if(chunking == STAGE_NONE)
+        return;
+    if(pthread_create(&thread, NULL, stage_timer_thread, NULL) != 0) {
+        fprintf(stderr, "Error starting staged write timer\n");
+        return;
+    }
+    pthread_detach(thread);
+}
+
+int chunking_enabled() {
+    return chunking != STAGE_NONE;
+}
@@ -0,0 +1,219 @@
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <mongo.h>
+#include "mongo-fuse.h"
+#include <snappy-c.h>
+#ifdef HAVE_LZ4
+#include <lz4.h>
+#endif
+#ifdef HAVE_ZSTD
+#include <zstd.h>
+#endif
+
+/*
+ * Block compression. Each mount compresses new blocks with one codec,
+ * but every block records the codec it was stored with, so blocks from
+ * mounts with different settings can be read side by side. Blocks without
+ * a codec field are snappy, which is all there was before; snappy blocks
+ * are still stored without one so they're unchanged for older mounts.
+ *
+ * With any other codec, a block is stored raw with codec "none" if
+ * compressing it wouldn't make it any smaller, which is what happens to
+ * data that's already compressed. Snappy blocks are always stored
+ * compressed, since older mounts can't read anything else. LZ4 and zstd
+ * are only available when built with HAVE_LZ4 and HAVE_ZSTD.
+ */
+
+static const char * codec_names[] = {
+    [CODEC_NONE] = "none",
+    [CODEC_SNAPPY] = "snappy",
+    [CODEC_LZ4] = "lz4",
+    [CODEC_ZSTD] = "zstd"
+};
+
+static int codec = CODEC_SNAPPY;
+#ifdef HAVE_ZSTD
+static int zstd_level = 3;
+static pthread_key_t zstd_key;
+
+struct zstd_ctx {
+    ZSTD_CCtx * cctx;
+    ZSTD_DCtx * dctx;
+};
+
+static void free_zstd_ctx(void * p) {
+    struct zstd_ctx * z = p;
+    ZSTD_freeCCtx(z->cctx);
+    ZSTD_freeDCtx(z->dctx);
+    free(z);
+}
+
+static struct zstd_ctx * get_zstd_ctx() {
+    struct zstd_ctx * z = pthread_getspecific(zstd_key);
+    if(z)
+        return z;
+    if((z = calloc(1, sizeof(struct zstd_ctx))) == NULL)
+        return NULL;
+    z->cctx = ZSTD_createCCtx();
+    z->dctx = ZSTD_createDCtx();
+    if(!z->cctx || !z->dctx) {
+        free_zstd_ctx(z);
+        return NULL;
+    }
+    pthread_setspecific(zstd_key, z);
+    return z;
+}
+#endif
+
+int codec_id(const char * name) {
+    int i;
+    for(i = 0; i < sizeof(codec_names) / sizeof(codec_names[0]); i++) {
+        if(strcmp(codec_names[i], name) == 0)
+            return i;
+    }
+    return -1;
+}
+
+const char * codec_name(int id) {
+    if(id < 0 || id >= sizeof(codec_names) / sizeof(codec_names[0]))
+        return "unknown";
+    return codec_names[id];
+}
+
+int setup_codec(const char * name, int level) {
+    int id = codec_id(name);
+
+    switch(id) {
+    case CODEC_NONE:
+    case CODEC_SNAPPY:
+        break;
+#ifdef HAVE_LZ4
+    case CODEC_LZ4:
+        break;
+#endif
+#ifdef HAVE_ZSTD
+    case CODEC_ZSTD:
+        if(level < ZSTD_minCLevel() || level > ZSTD_maxCLevel()) {
+            fprintf(stderr, "zstd level must be from %d to %d\n",
+                ZSTD_minCLevel(), ZSTD_maxCLevel());
+            return -EINVAL;
+        }
+        zstd_level = level;
+        break;
+#endif
+    default:
+        fprintf(stderr, "Unknown or unsupported codec %s\n", name);
+        return -EINVAL;
+    }
+    codec = id;
+#ifdef HAVE_ZSTD
+    // Any mount may have zstd blocks to read.
+    pthread_key_create(&zstd_key, free_zstd_ctx);
+#endif
+    return 0;
+}
+
+/*
+ * Compresses len bytes of data with the mount's codec. Sets *out to the
+ * bytes to store, which may be data itself, and returns the codec they're
+ * stored with.
+ */
+int compress_block(const char * data, size_t len,
+    const char ** out, size_t * outlen) {
+    char * buf = get_compress_buf();
+    size_t n = 0;
+    int res;
+
+    if(!buf)
+        return -ENOMEM;
+
+    switch(codec) {
+    case CODEC_SNAPPY:
+        n = snappy_max_compressed_length(len);
+        if((res = snappy_compress(data, len, buf, &n)) != SNAPPY_OK) {
+            fprintf(stderr, "Error compressing input: %d\n", res);
+            return -EIO;
+        }
+        break;
+#ifdef HAVE_LZ4
+    case CODEC_LZ4:
+        // Anything that doesn't fit in len bytes is no use anyway, and
+        // comes back as 0.
+        n = LZ4_compress_default(data, buf, len, len);
+        break;
+#endif
+#ifdef HAVE_ZSTD
+    case CODEC_ZSTD: {
+        struct zstd_ctx * z = get_zstd_ctx();
+        if(!z)
+            return -ENOMEM;
+        n = ZSTD_compressCCtx(z->cctx, buf, len, data, len, zstd_level);
+        if(ZSTD_isError(n))
+            n = 0;
+        break;
+    }
+#endif
+    }
+
+    if(codec != CODEC_SNAPPY && (n == 0 || n >= len)) {
+        *out = data;
+        *outlen = len;
+        return CODEC_NONE;
+    }
+    *out = buf;
+    *outlen = n;
+    return codec;
+}
+
+/*
+ * Decompresses a block stored with codec id into out, which has room for
+ * *outlen bytes. Sets *outlen to the decompressed length.
+ */
+int decompress_block(int id, const char * in, size_t inlen,
+    char * out, size_t * outlen) {
+    int res;
+
+    switch(id) {
+    case CODEC_NONE:
+        if(inlen > *outlen)
+            break;
+        memcpy(out, in, inlen);
+        *outlen = inlen;
+        return 0;
+    case CODEC_SNAPPY:
+        if((res = snappy_uncompress(in, inlen, out, outlen)) != SNAPPY_OK) {
+            fprintf(stderr, "Error uncompressing block %d\n", res);
+            return -EIO;
+        }
+        return 0;
+#ifdef HAVE_LZ4
+    case CODEC_LZ4:
+        if((res = LZ4_decompress_safe(in, out, inlen, *outlen)) < 0)
+            break;
+        *outlen = res;
+        return 0;
+#endif
+#ifdef HAVE_ZSTD
+    case CODEC_ZSTD: {
+        struct zstd_ctx * z = get_zstd_ctx();
+        size_t n;
+        if(!z)
+            return -ENOMEM;
+        n = ZSTD_decompressDCtx(z->dctx, out, *outlen, in, inlen);
+        if(ZSTD_isError(n))
+            break;
+        *outlen = n;
+        return 0;
+    }
+#endif
+    default:
+        fprintf(stderr, "Block uses %s compression, which this build "
+            "doesn't support\n", codec_name(id));
+        return -EIO;
+    }
+    fprintf(stderr, "Error uncompressing %s block\n", codec_name(id));
+    return -EIO;
+}
@@ -0,0 +1,187 @@
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <time.h>
+#include <unistd.h>
+#include <mongo.h>
+#include "mongo-fuse.h"
+
+/*
+ * Background extent compaction. Flushes only ever append extent
+ * documents (see extents.c), so a file that's flushed often builds up
+ * documents that are mostly shadowed by newer ones, and reading it means
+ * merging all of them. serialize_extent notes how many documents each
+ * file gets here, and reading a file's extents notes how many it already
+ * has, so files whose logs grew under earlier mounts are found too. Once
+ * a file has compact_threshold uncompacted documents a background thread
+ * rewrites it into a few large ones.
+ *
+ * Only documents older than COMPACT_SETTLE_SECS are compacted, so files
+ * that are still being written aren't merged over and over. That's only
+ * to save work: merged documents sort below everything they didn't
+ * replace (see compact_extents), so a flush caught half-inserted, or one
+ * from a mount whose clock is behind ours, still applies on top. Files
+ * are compacted once they've been quiet that long, or straight away if
+ * they're written so often that they never are.
+ */
+
+#define COMPACT_BUCKETS 256
+#define COMPACT_MAX_FILES 4096
+#define COMPACT_SETTLE_SECS 10
+#define COMPACT_BUSY_FACTOR 8
+
+struct compact_file {
+    struct compact_file * next;
+    bson_oid_t oid;
+    int ndocs;
+    time_t last;
+};
+
+static pthread_mutex_t compact_lock = PTHREAD_MUTEX_INITIALIZER;
+static struct compact_file * buckets[COMPACT_BUCKETS];
+static int nfiles = 0;
+static int compact_threshold = 0;
+
+static unsigned int oid_bucket(const bson_oid_t * oid) {
+    unsigned int h = 2166136261u;
+    int i;
+    for(i = 0; i < sizeof(oid->bytes); i++)
+        h = (h ^ (uint8_t)oid->bytes[i]) * 16777619u;
+    return h % COMPACT_BUCKETS;
+}
+
+/*
+ * Makes room for another file by forgetting one that isn't due yet. Must
+ * be called with compact_lock held.
+ */
+static int evict_file() {
+    struct compact_file ** p, * f;
+    int i;
+
+    for(i = 0; i < COMPACT_BUCKETS; i++) {
+        for(p = &buckets[i]; (f = *p) != NULL; p = &f->next) {
+            if(f->ndocs >= compact_threshold)
+                continue;
+            *p = f->next;
+            free(f);
+            nfiles--;
+            return 1;
+        }
+    }
+    return 0;
+}
+
+static void note_file(const bson_oid_t * oid, int ndocs, int total) {
+    struct compact_file * f;
+    unsigned int b;
+
+    if(compact_threshold == 0 || ndocs <= 0)
+        return;
+
+    b = oid_bucket(oid);
+    pthread_mutex_lock(&compact_lock);
+    for(f = buckets[b]; f; f = f->next) {
+        if(memcmp(&f->oid, oid, sizeof(bson_oid_t)) == 0)
+            break;
+    }
+    // A file that's due is worth more than one that isn't. Otherwise it
+    // has to wait for room, and is noted again next time it's read.
+    if(!f && nfiles >= COMPACT_MAX_FILES && total &&
+        ndocs >= compact_threshold)
+        evict_file();
+    if(!f && nfiles < COMPACT_MAX_FILES &&
+        (f = calloc(1, sizeof(struct compact_file))) != NULL) {
+        f->oid = *oid;
+        f->next = buckets[b];
+        buckets[b] = f;
+        nfiles++;
+    }
+    if(f) {
+        if(!total)
+            f->ndocs += ndocs;
+        else if(ndocs > f->ndocs)
+            f->ndocs = ndocs;
+        if(!total || !f->last)
+            f->last = time(NULL);
+    }
+    pthread_mutex_unlock(&compact_lock);
+}
+
+/* Records that ndocs extent documents were just written for a file. */
+void note_extent_docs(const bson_oid_t * oid, int ndocs) {
+    note_file(oid, ndocs, 0);
+}
+
+/*
+ * Records that a file was found to have at least ndocs uncompacted extent
+ * documents.
+ */
+void note_extent_count(const bson_oid_t * oid, int ndocs) {
+    note_file(oid, ndocs, 1);
+}
+
+/* Must be called with compact_lock held. */
+static struct compact_file * take_ready(time_t now) {
+    struct compact_file ** p, * f;
+    int i;
+
+    for(i = 0; i < COMPACT_BUCKETS; i++) {
+        for(p = &buckets[i]; (f = *p) != NULL; p = &f->next) {
+            if(f->ndocs < compact_threshold)
+                continue;
+            if(now - f->last < COMPACT_SETTLE_SECS &&
+                f->ndocs < compact_threshold * COMPACT_BUSY_FACTOR)
+                continue;
+            *p = f->next;
+            nfiles--;
+            return f;
+        }
+    }
+    return NULL;
+}
+
+static void * compact_thread(void * arg) {
+    struct compact_file * f;
+    struct timespec ts;
+    int64_t settled;
+    int res;
+
+    for(;;) {
+        sleep(COMPACT_SETTLE_SECS);
+
+        for(;;) {
+            pthread_mutex_lock(&compact_lock);
+            f = take_ready(time(NULL));
+            pthread_mutex_unlock(&compact_lock);
+            if(!f)
+                break;
+
+            // Extent versions are microseconds since the epoch.
+            clock_gettime(CLOCK_REALTIME, &ts);
+            settled = ((int64_t)ts.tv_sec - COMPACT_SETTLE_SECS) * 1000000;
+            res = compact_extents(&f->oid, settled);
+            if(res < 0 && res != -EAGAIN)
+                fprintf(stderr, "Error compacting extents: %d\n", res);
+            free(f);
+        }
+    }
+    return NULL;
+}
+
+void setup_compaction(int threshold) {
+    compact_threshold = threshold > 0 ? threshold : 0;
+}
+
+void start_compactor() {
+    pthread_t thread;
+
+    if(compact_threshold == 0)
+        return;
+    if(pthread_create(&thread, NULL, compact_thread, NULL) != 0) {
+        fprintf(stderr, "Error starting extent compactor\n");
+        return;
+    }
+    pthread_detach(thread);
+}
@@ -0,0 +1,272 @@
+#include <pthread.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <mongo.h>
+#include "mongo-fuse.h"
+
+/*
+ * Client-side index of blocks known to be in the blocks collection, so
+ * writes of data we've already stored can skip compression and the
+ * upsert. There are two layers:
+ *
+ * - An exact LRU of recently stored hashes. A hit here means the block
+ *   is definitely stored and the write is skipped outright.
+ * - A Bloom filter over every hash we've stored or seen, optionally
+ *   seeded at mount time from the blocks collection. A miss means the
+ *   block is definitely new; a hit only means it might exist, so
+ *   store_blocks confirms those with an _id-only query before skipping.
+ *
+ * Blocks are never deleted, so nothing here ever needs invalidating.
+ */
+
+#define DEDUP_SHARDS 16
+#define BLOOM_HASHES 4
+
+struct seen_hash {
+    struct seen_hash * hnext;
+    struct seen_hash * lru_prev;
+    struct seen_hash * lru_next;
+    uint8_t hash[HASH_LEN];
+};
+
+struct seen_shard {
+    pthread_mutex_t lock;
+    struct seen_hash ** buckets;
+    uint32_t nbuckets;
+    struct seen_hash * lru_head;
+    struct seen_hash * lru_tail;
+    size_t count;
+    size_t limit;
+};
+
+static struct seen_shard shards[DEDUP_SHARDS];
+static int lru_enabled = 0;
+
+static uint64_t * bloom = NULL;
+static uint32_t bloom_mask = 0;
+
+extern char * blocks_name;
+
+static struct {
+    unsigned long lru_hits;
+    unsigned long confirmed;
+    unsigned long false_positives;
+    unsigned long stored;
+} stats;
+
+static uint32_t hash_word(const uint8_t hash[HASH_LEN], int n) {
+    uint32_t out;
+    memcpy(&out, hash + n * sizeof(out), sizeof(out));
+    return out;
+}
+
+void setup_dedup(size_t bloom_mb, size_t lru_entries) {
+    size_t per_shard = lru_entries / DEDUP_SHARDS;
+    uint32_t nbuckets = 16;
+    uint64_t nbits;
+    int i;
+
+    if(bloom_mb > 0) {
+        // Bit positions come from 32-bit words of the hash.
+        if(bloom_mb > 512)
+            bloom_mb = 512;
+        nbits = (uint64_t)1 << 23;
+        while((nbits << 1) <= ((uint64_t)bloom_mb << 23))
+            nbits <<= 1;
+        if((bloom = calloc(nbits / 64, sizeof(uint64_t))) == NULL)
+            fprintf(stderr, "Error allocating dedup filter\n");
+        else
+            bloom_mask = nbits - 1;
+    }
+
+    if(per_shard == 0)
+        return;
+    while(nbuckets < per_shard)
+        nbuckets <<= 1;
+    for(i = 0; i < DEDUP_SHARDS; i++) {
+        struct seen_shard * s = &shards[i];
+        pthread_mutex_init(&s->lock, NULL);
+        if((s->buckets = calloc(nbuckets, sizeof(struct seen_hash*))) == NULL) {
+            fprintf(stderr, "Error allocating dedup index\n");
+            return;
+        }
+        s->nbuckets = nbuckets;
+        s->limit = per_shard;
+    }
+    lru_enabled = 1;
+}
+
+static struct seen_hash ** find_slot(struct seen_shard * s,
+    const uint8_t hash[HASH_LEN]) {
+    struct seen_hash ** slot =
+        &s->buckets[hash_word(hash, 1) & (s->nbuckets - 1)];
+    while(*slot && memcmp((*slot)->hash, hash, HASH_LEN) != 0)
+        slot = &(*slot)->hnext;
+    return slot;
+}
+
+static void lru_unlink(struct seen_shard * s, struct seen_hash * h) {
+    if(h->lru_prev)
+        h->lru_prev->lru_next = h->lru_next;
+    else
+        s->lru_head = h->lru_next;
+    if(h->lru_next)
+        h->lru_next->lru_prev = h->lru_prev;
+    else
+        s->lru_tail = h->lru_prev;
+}
+
+static void lru_push(struct seen_shard * s, struct seen_hash * h) {
+    h->lru_prev = NULL;
+    h->lru_next = s->lru_head;
+    if(s->lru_head)
+        s->lru_head->lru_prev = h;
+    s->lru_head = h;
+    if(!s->lru_tail)
+        s->lru_tail = h;
+}
+
+static void bloom_add(const uint8_t hash[HASH_LEN]) {
+    int i;
+    if(!bloom)
+        return;
+    for(i = 0; i < BLOOM_HASHES; i++) {
+        uint32_t bit = hash_word(hash, i) & bloom_mask;
+        __sync_fetch_and_or(&bloom[bit / 64], (uint64_t)1 << (bit % 64));
+    }
+}
+
+int dedup_maybe(const uint8_t hash[HASH_LEN]) {
+    int i;
+    if(!bloom)
+        return 0;
+    for(i = 0; i < BLOOM_HASHES; i++) {
+        uint32_t bit = hash_word(hash, i) & bloom_mask;
+        if(!(bloom[bit / 64] & ((uint64_t)1 << (bit % 64))))
+            return 0;
+    }
+    return 1;
+}
+
+int dedup_known(const uint8_t hash[HASH_LEN]) {
+    struct seen_shard * s;
+    struct seen_hash * h;
+
+    if(!lru_enabled)
+        return 0;
+
+    s = &shards[hash[0] % DEDUP_SHARDS];
+    pthread_mutex_lock(&s->lock);
+    if((h = *find_slot(s, hash)) != NULL && s->lru_head != h) {
+        lru_unlink(s, h);
+        lru_push(s, h);
+    }
+    pthread_mutex_unlock(&s->lock);
+
+    if(h)
+        __sync_fetch_and_add(&stats.lru_hits, 1);
+    return h != NULL;
+}
+
+/* Records that hash is definitely in the blocks collection. */
+void dedup_add(const uint8_t hash[HASH_LEN]) {
+    struct seen_shard * s;
+    struct seen_hash * h, ** slot;
+
+    bloom_add(hash);
+    if(!lru_enabled)
+        return;
+
+    s = &shards[hash[0] % DEDUP_SHARDS];
+    pthread_mutex_lock(&s->lock);
+    if(*find_slot(s, hash)) {
+        pthread_mutex_unlock(&s->lock);
+        return;
+    }
+
+    if(s->count >= s->limit) {
+        // Recycle the least recently used entry.
+        h = s->lru_tail;
+        slot = find_slot(s, h->hash);
+        *slot = h->hnext;
+        lru_unlink(s, h);
+        s->count--;
+    } else if((h = malloc(sizeof(struct seen_hash))) == NULL) {
+        pthread_mutex_unlock(&s->lock);
+        return;
+    }
+
+    memcpy(h->hash, hash, HASH_LEN);
+    slot = find_slot(s, hash);
+    h->hnext = NULL;
+    *slot = h;
+    lru_push(s, h);
+    s->count++;
+    pthread_mutex_unlock(&s->lock);
+}
+
+void dedup_count(int stored, int confirmed, int false_positives) {
+    __sync_fetch_and_add(&stats.stored, stored);
+    __sync_fetch_and_add(&stats.confirmed, confirmed);
+    __sync_fetch_and_add(&stats.false_positives, false_positives);
+}
+
+int dedup_stats(char * buf, size_t len) {
+    unsigned long hits = stats.lru_hits + stats.confirmed;
+    unsigned long total = hits + stats.stored;
+
+    return snprintf(buf, len, "hits=%lu lru_hits=%lu confirmed=%lu "
+        "false_positives=%lu stored=%lu ratio=%.3f\n", hits, stats.lru_hits,
+        stats.confirmed, stats.false_positives, stats.stored,
+        total ? (double)hits / total : 0.0);
+}
+
+static void * seed_thread(void * arg) {
+    mongo_cursor curs;
+    bson fields;
+    bson_iterator i;
+    uint8_t hash[HASH_LEN];
+    unsigned long seeded = 0;
+
+    bson_init(&fields);
+    bson_append_int(&fields, "_id", 1);
+    bson_finish(&fields);
+
+    mongo_cursor_init(&curs, get_conn(), blocks_name);
+    mongo_cursor_set_query(&curs, bson_shared_empty());
+    mongo_cursor_set_fields(&curs, &fields);
+
+    while(mongo_cursor_next(&curs) == MONGO_OK) {
+        if(bson_find(&i, mongo_cursor_bson(&curs), "_id") != BSON_BINDATA ||
+            bson_iterator_bin_len(&i) != hash_len)
+            continue;
+        memset(hash, 0, HASH_LEN);
+        memcpy(hash, bson_iterator_bin_data(&i), hash_len);
+        bloom_add(hash);
+        seeded++;
+    }
+    if(curs.err != MONGO_CURSOR_EXHAUSTED)
+        fprintf(stderr, "Error seeding dedup filter after %lu blocks\n",
+            seeded);
+    mongo_cursor_destroy(&curs);
+    bson_destroy(&fields);
+    return NULL;
+}
+
+/*
+ * Loads the hashes of every stored block into the Bloom filter in the
+ * background. Until it finishes, blocks it hasn't reached yet are just
+ * written again, which is harmless.
+ */
+void seed_dedup() {
+    pthread_t thread;
+
+    if(!bloom)
+        return;
+    if(pthread_create(&thread, NULL, seed_thread, NULL) != 0) {
+        fprintf(stderr, "Error starting dedup seed thread\n");
+        return;
+    }
+    pthread_detach(thread);
+}
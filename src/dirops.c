@@ -19,25 +19,25 @@ extern char empty_hash[];
 struct readdir_data {
     fuse_fill_dir_t filler;
     void * buf;
+    unsigned long seq;
 };
 
 int read_dirents(const char * directory,
     int (*dirent_cb)(struct inode *e, void * p,
-    const char * parent, size_t parentlen), void * p) {
+    const char * parent, size_t parentlen), void * p, int fields) {
     bson query;
     mongo_cursor curs;
     size_t pathlen = strlen(directory);
-    char regexp[PATH_MAX + 10];
     int res;
     mongo * conn = get_conn();
 
-    sprintf(regexp, "^%s/[^/]+$", pathlen == 1 ? directory + 1 : directory);
     bson_init(&query);
-    bson_append_regex(&query, "dirents", regexp, "");
+    bson_append_string(&query, "parents", directory);
     bson_finish(&query);
 
     mongo_cursor_init(&curs, conn, inodes_name);
     mongo_cursor_set_query(&curs, &query);
+    mongo_cursor_set_fields(&curs, inode_fields(fields));
 
     while((res = mongo_cursor_next(&curs)) == MONGO_OK) {
         struct inode e;
@@ -71,6 +71,7 @@ int readdir_cb(struct inode * e, void * p,
     if(parentlen > 1)
         printlen++;
 
+    memset(&stbuf, 0, sizeof(stbuf));
     stbuf.st_nlink = 1;
     stbuf.st_mode = e->mode;
     if(stbuf.st_mode & S_IFDIR)
@@ -84,11 +85,16 @@ int readdir_cb(struct inode * e, void * p,
 
     struct dirent * cde = e->dirents;
     while(cde) {
-        if(strncmp(cde->path, parent, parentlen) != 0 ||
+        // Other links to this inode may be in other directories.
+        if(parent_len(cde->path, cde->len) != parentlen ||
+            strncmp(cde->path, parent, parentlen) != 0 ||
             strcmp(cde->path + printlen, ".snapshot") == 0) {
             cde = cde->next;
             continue;
         }
+        // The kernel will getattr each entry next, and we already have
+        // everything it needs.
+        meta_cache_put(cde->path, e, rd->seq);
         rd->filler(rd->buf, cde->path + printlen, &stbuf, 0);
         cde = cde->next;
     }
@@ -103,10 +109,11 @@ int mongo_readdir(const char *path, void *buf, fuse_fill_dir_t filler,
 
     struct readdir_data rb = {
         .filler = filler,
-        .buf = buf
+        .buf = buf,
+        .seq = meta_cache_seq()
     };
 
-    return read_dirents(path, readdir_cb, &rb);
+    return read_dirents(path, readdir_cb, &rb, FIELDS_LISTING);
 }
 
 int mongo_mkdir(const char * path, mode_t mode) {
@@ -137,7 +144,7 @@ int orphan_snapshot(struct inode *e, void * p,
     if(e->mode & S_IFDIR) {
             nslashes--;
         if((res = read_dirents(cde->path,
-            orphan_snapshot, (void*)topparent)) != 0)
+            orphan_snapshot, (void*)topparent, FIELDS_ALL)) != 0)
             return res;
     }
 
@@ -177,15 +184,15 @@ int mongo_rmdir(const char * path) {
     int res;
     double dres;
     bson cond;
-    char regexp[PATH_MAX + 25];
+    char snapdir[PATH_MAX + 11];
     mongo * conn = get_conn();
 
     if((res = inode_exists(path)) != 0)
         return res;
 
-    sprintf(regexp, "^%s/[^/]+$", path);
+    // The .snapshot directory is always there.
     bson_init(&cond);
-    bson_append_regex(&cond, "dirents", regexp, "");
+    bson_append_string(&cond, "parents", path);
     bson_finish(&cond);
 
     dres = mongo_count(conn, dbname, inodes_coll, &cond);
@@ -195,33 +202,37 @@ int mongo_rmdir(const char * path) {
         return -ENOTEMPTY;
 
     if(strstr(path, "/.snapshot") == NULL) {
-        sprintf(regexp, "%s/.snapshot", path);
-        if((res = get_inode(regexp, &e)) != 0)
+        sprintf(snapdir, "%s/.snapshot", path);
+        if((res = get_inode(snapdir, &e)) != 0)
             return res;
 
-        sprintf(regexp, "^%s/.snapshot/", path);
         bson_init(&cond);
-        bson_append_regex(&cond, "dirents", regexp, "");
+        bson_append_string(&cond, "parents", snapdir);
         bson_finish(&cond);
 
         dres = mongo_count(conn, dbname, inodes_coll, &cond);
         bson_destroy(&cond);
 
-        if(dres > 0) {
+        if(dres > 0)
             res = orphan_snapshot(&e, (void*)path, NULL, 0);
-            free_inode(&e);
-            if(res != 0)
-                return res;
-        }
+        free_inode(&e);
+        if(res != 0)
+            return res;
     }
 
-    sprintf(regexp, "^%s", path);
+    sprintf(snapdir, "%s/.snapshot", path);
     bson_init(&cond);
-    bson_append_regex(&cond, "dirents", regexp, "");
+    bson_append_start_object(&cond, "dirents");
+    bson_append_start_array(&cond, "$in");
+    bson_append_string(&cond, "0", path);
+    bson_append_string(&cond, "1", snapdir);
+    bson_append_finish_array(&cond);
+    bson_append_finish_object(&cond);
     bson_finish(&cond);
 
     res = mongo_remove(conn, inodes_name, &cond, NULL);
     bson_destroy(&cond);
+    meta_cache_invalidate_tree(path);
     if(res != MONGO_OK) {
         fprintf(stderr, "Error removing inode entry for %s\n", path);
         return -EIO;
@@ -236,7 +247,7 @@ int create_snapshot(struct inode * e, void * p, const char * parent, size_t plen
     size_t pathlen = e->dirents->len;
     char * filename = (char*)path + pathlen;
     char * generation = (char*)p;
-    struct elist * root = NULL;
+    struct etree * root = NULL;
 
     if(!root)
         return -ENOMEM;
@@ -250,7 +261,7 @@ int create_snapshot(struct inode * e, void * p, const char * parent, size_t plen
     bson_oid_gen(&newid);
     memcpy(&e->oid, &newid, sizeof(bson_oid_t));
     res = serialize_extent(e, root);
-    free(root);
+    free_etree(root);
     
     while(*(filename-1) != '/') filename--;
     struct dirent * d = malloc(sizeof(struct dirent) + pathlen + 21);
@@ -289,31 +300,41 @@ int snapshot_dir(const char * path, size_t pathlen, mode_t mode) {
     if((res = create_inode(regexp, mode, NULL)) != 0)
         return res;
 
-    return read_dirents(dirpath, create_snapshot, snapshotname);
+    return read_dirents(dirpath, create_snapshot, snapshotname, FIELDS_ALL);
 }
 
 int mongo_rename(const char * path, const char * newpath) {
-    mongo * conn = get_conn();
-    bson query, doc;
+    struct inode e;
+    struct dirent ** pcde, * nd;
+    size_t newpathlen = strlen(newpath);
     int res;
 
-    bson_init(&query);
-    bson_append_string(&query, "dirents", path);
-    bson_finish(&query);
-
-    bson_init(&doc);
-    bson_append_start_object(&doc, "$set");
-    bson_append_string(&doc, "dirents.$", newpath);
-    bson_append_finish_object(&doc);
-    bson_finish(&doc);
+    // The whole inode is rewritten rather than just the one dirent so its
+    // parents stay in step.
+    if((res = get_inode(path, &e)) != 0)
+        return res;
 
-    res = mongo_update(conn, inodes_name, &query, &doc,
-        MONGO_UPDATE_BASIC, NULL);
-    bson_destroy(&doc);
-    bson_destroy(&query);
+    pcde = &e.dirents;
+    while(*pcde && strcmp((*pcde)->path, path) != 0)
+        pcde = &(*pcde)->next;
+    if(!*pcde) {
+        free_inode(&e);
+        return -ENOENT;
+    }
 
-    if(res != MONGO_OK)
-        return -EIO;
-    return inode_exists(newpath);
+    if((nd = malloc(sizeof(struct dirent) + newpathlen)) == NULL) {
+        free_inode(&e);
+        return -ENOMEM;
+    }
+    strcpy(nd->path, newpath);
+    nd->len = newpathlen;
+    nd->next = (*pcde)->next;
+    free(*pcde);
+    *pcde = nd;
+
+    res = commit_inode(&e);
+    meta_cache_invalidate(path);
+    free_inode(&e);
+    return res;
 }
 
@@ -3,190 +3,533 @@
 #include <stdlib.h>
 #include <string.h>
 #include <errno.h>
+#include <time.h>
 #include <bson.h>
 #include <mongo.h>
 #include "mongo-fuse.h"
 
 extern char * extents_name;
 
-struct elist * init_elist() {
-	const size_t malloc_size = sizeof(struct elist) +
-		(sizeof(struct enode) * BLOCKS_PER_EXTENT);
-	struct elist * out = malloc(malloc_size);
+// Files with more blocks than this are read with a range query each time
+// rather than keeping their whole extent map in memory.
+#define EXTENT_MAP_LIMIT (BLOCKS_PER_EXTENT * 256)
+
+/*
+ * Extents are kept in an AA tree of non-overlapping nodes keyed by file
+ * offset. Inserting a range trims, splits or removes whatever it
+ * overlaps, so the tree always describes the current contents of the
+ * file and lookups and in-order walks never see shadowed data.
+ */
+
+static int node_level(struct enode * t) {
+	return t ? t->level : 0;
+}
+
+static struct enode * skew(struct enode * t) {
+	struct enode * l;
+	if(!t || !t->link[LEFT] || t->link[LEFT]->level != t->level)
+		return t;
+	l = t->link[LEFT];
+	t->link[LEFT] = l->link[RIGHT];
+	l->link[RIGHT] = t;
+	return l;
+}
+
+static struct enode * split(struct enode * t) {
+	struct enode * r;
+	if(!t || !t->link[RIGHT] || !t->link[RIGHT]->link[RIGHT] ||
+		t->link[RIGHT]->link[RIGHT]->level != t->level)
+		return t;
+	r = t->link[RIGHT];
+	t->link[RIGHT] = r->link[LEFT];
+	r->link[LEFT] = t;
+	r->level++;
+	return r;
+}
+
+static struct enode * tree_insert(struct enode * t, struct enode * n) {
+	int dir;
+	if(!t)
+		return n;
+	dir = n->off > t->off;
+	t->link[dir] = tree_insert(t->link[dir], n);
+	return split(skew(t));
+}
+
+static struct enode * tree_remove(struct enode * t, off_t key,
+	struct enode ** removed) {
+	if(!t)
+		return NULL;
+
+	if(t->off == key) {
+		struct enode * heir;
+		if(!t->link[LEFT] || !t->link[RIGHT]) {
+			*removed = t;
+			return t->link[LEFT] ? t->link[LEFT] : t->link[RIGHT];
+		}
+		// Move the in-order predecessor's contents here and remove it
+		// from the left subtree instead.
+		heir = t->link[LEFT];
+		while(heir->link[RIGHT])
+			heir = heir->link[RIGHT];
+		t->off = heir->off;
+		t->len = heir->len;
+		t->blkoff = heir->blkoff;
+		t->empty = heir->empty;
+		memcpy(t->hash, heir->hash, HASH_LEN);
+		t->link[LEFT] = tree_remove(t->link[LEFT], heir->off, removed);
+	} else {
+		int dir = key > t->off;
+		t->link[dir] = tree_remove(t->link[dir], key, removed);
+	}
+
+	if(node_level(t->link[LEFT]) < t->level - 1 ||
+		node_level(t->link[RIGHT]) < t->level - 1) {
+		if(node_level(t->link[RIGHT]) > --t->level)
+			t->link[RIGHT]->level = t->level;
+		t = skew(t);
+		t->link[RIGHT] = skew(t->link[RIGHT]);
+		if(t->link[RIGHT])
+			t->link[RIGHT]->link[RIGHT] = skew(t->link[RIGHT]->link[RIGHT]);
+		t = split(t);
+		t->link[RIGHT] = split(t->link[RIGHT]);
+	}
+	return t;
+}
+
+static void free_nodes(struct enode * t) {
+	while(t) {
+		struct enode * r = t->link[RIGHT];
+		free_nodes(t->link[LEFT]);
+		free(t);
+		t = r;
+	}
+}
+
+struct etree * init_etree() {
+	struct etree * out = malloc(sizeof(struct etree));
 	if(!out)
 		return NULL;
-	memset(out, 0, sizeof(struct elist));
-	out->nslots = BLOCKS_PER_EXTENT;
+	memset(out, 0, sizeof(struct etree));
 	return out;
 }
 
-int ensure_elist(struct elist ** pout) {
-	struct elist * out = *pout;
-	if(out == NULL) {
-		out = init_elist();
-		if(!out) {
-			*pout = NULL;
-			return -ENOMEM;
-		}
-		*pout = out;
+void clear_etree(struct etree * tree) {
+	free_nodes(tree->root);
+	tree->root = NULL;
+	tree->nnodes = 0;
+}
+
+void free_etree(struct etree * tree) {
+	if(!tree)
+		return;
+	clear_etree(tree);
+	free(tree);
+}
+
+/* Smallest node whose key is >= off. */
+static struct enode * find_ceil(struct etree * tree, off_t off) {
+	struct enode * t = tree->root, * out = NULL;
+	while(t) {
+		if(t->off >= off) {
+			out = t;
+			t = t->link[LEFT];
+		} else
+			t = t->link[RIGHT];
 	}
-	if(out->nnodes + 1 < out->nslots)
+	return out;
+}
+
+/* Largest node whose key is < off. */
+static struct enode * find_floor(struct etree * tree, off_t off) {
+	struct enode * t = tree->root, * out = NULL;
+	while(t) {
+		if(t->off < off) {
+			out = t;
+			t = t->link[RIGHT];
+		} else
+			t = t->link[LEFT];
+	}
+	return out;
+}
+
+static struct enode * new_enode(const struct enode * src) {
+	struct enode * n = malloc(sizeof(struct enode));
+	if(!n)
+		return NULL;
+	memcpy(n, src, sizeof(struct enode));
+	n->link[LEFT] = n->link[RIGHT] = NULL;
+	n->level = 1;
+	return n;
+}
+
+int insert_enode(struct etree ** ptree, const struct enode * src) {
+	struct etree * tree = *ptree;
+	struct enode * n, * cur, * tail = NULL, * removed;
+	const off_t end = src->off + src->len;
+
+	if(src->len == 0)
 		return 0;
-	out->nslots += BLOCKS_PER_EXTENT;
-	out = realloc(out, sizeof(struct elist) +
-		(sizeof(struct enode) * out->nslots));
-	if(!out)
+	if(!tree) {
+		if((tree = init_etree()) == NULL)
+			return -ENOMEM;
+		*ptree = tree;
+	}
+	if((n = new_enode(src)) == NULL)
 		return -ENOMEM;
-	*pout = out;
+
+	// A node starting before us either ends before we start, gets its
+	// tail cut off, or covers us entirely and has to be split in two.
+	cur = find_floor(tree, src->off);
+	if(cur && cur->off + (off_t)cur->len > src->off) {
+		const off_t curend = cur->off + cur->len;
+		if(curend > end) {
+			if((tail = new_enode(cur)) == NULL) {
+				free(n);
+				return -ENOMEM;
+			}
+			tail->blkoff += end - cur->off;
+			tail->off = end;
+			tail->len = curend - end;
+		}
+		cur->len = src->off - cur->off;
+	}
+
+	// Nodes starting inside our range are removed unless they run past
+	// its end, in which case their head is cut off. Moving that node's
+	// key to our end keeps it between its neighbours.
+	while((cur = find_ceil(tree, src->off)) && cur->off < end) {
+		const off_t curend = cur->off + cur->len;
+		if(curend > end) {
+			cur->blkoff += end - cur->off;
+			cur->len = curend - end;
+			cur->off = end;
+			break;
+		}
+		removed = NULL;
+		tree->root = tree_remove(tree->root, cur->off, &removed);
+		free(removed);
+		tree->nnodes--;
+	}
+
+	tree->root = tree_insert(tree->root, n);
+	tree->nnodes++;
+	if(tail) {
+		tree->root = tree_insert(tree->root, tail);
+		tree->nnodes++;
+	}
 	return 0;
 }
 
-int insert_hash(struct elist ** pout, off_t off, size_t len,
+int insert_hash(struct etree ** ptree, off_t off, size_t len,
 	uint8_t hash[HASH_LEN]) {
-	int res, idx;
-	if((res = ensure_elist(pout)) != 0)
-		return res;
+	struct enode n;
 
-	struct elist * out = *pout;
+	memset(&n, 0, sizeof(n));
+	n.off = off;
+	n.len = len;
+	memcpy(n.hash, hash, HASH_LEN);
+	return insert_enode(ptree, &n);
+}
 
-	idx = out->nnodes++;
-	out->list[idx].off = off;
-	out->list[idx].len = len;
-	out->list[idx].empty = 0;
-	out->list[idx].seq = idx;
-	memcpy(out->list[idx].hash, hash, HASH_LEN);
+int insert_empty(struct etree ** ptree, off_t off, size_t len) {
+	struct enode n;
 
-	return 0;
+	memset(&n, 0, sizeof(n));
+	n.off = off;
+	n.len = len;
+	n.empty = 1;
+	return insert_enode(ptree, &n);
 }
 
-int insert_empty(struct elist ** pout, off_t off, size_t len) {
-	int res, idx;
-	if((res = ensure_elist(pout)) != 0)
-		return res;
+static struct enode * iter_pop(struct etree_iter * it) {
+	struct enode * n, * t;
 
-	struct elist * out = *pout;
+	if(it->top == 0)
+		return NULL;
+	n = it->stack[--it->top];
+	if(n->off >= it->end) {
+		it->top = 0;
+		return NULL;
+	}
+	for(t = n->link[RIGHT]; t; t = t->link[LEFT])
+		it->stack[it->top++] = t;
+	return n;
+}
 
-	idx = out->nnodes++;
-	out->list[idx].off = off;
-	out->list[idx].len = len;
-	out->list[idx].empty = 1;
-	out->list[idx].seq = idx;
-	
-	return 0;
+/*
+ * Starts an in-order walk over the nodes of tree that overlap
+ * [off, end). The tree must not be modified until the walk is done.
+ */
+struct enode * etree_first(struct etree * tree, struct etree_iter * it,
+	off_t off, off_t end) {
+	struct enode * t = tree ? tree->root : NULL;
+
+	it->top = 0;
+	it->end = end;
+	while(t) {
+		if(t->off + (off_t)t->len > off) {
+			it->stack[it->top++] = t;
+			t = t->link[LEFT];
+		} else
+			t = t->link[RIGHT];
+	}
+	return iter_pop(it);
 }
 
-int enode_cmp(const void * ra, const void * rb) {
-	struct enode * a = (struct enode *)ra;
-	struct enode * b = (struct enode *)rb;
+struct enode * etree_next(struct etree_iter * it) {
+	return iter_pop(it);
+}
 
-	int res = (a->seq > b->seq) - (a->seq < b->seq);
-	if(res == 0)
-		res = (a->off > b->off) - (a->off < b->off);
-	return res;
+/*
+ * Extent documents are an append-only log. Each flush inserts its runs as
+ * new documents, all with the same version, and nothing is rewritten or
+ * removed; readers apply documents oldest version first so newer ones
+ * overwrite whatever they overlap. Versions are microseconds since the
+ * epoch, bumped so they're unique within a mount. Documents from before
+ * versions existed sort first, by _id as they always were. compact.c
+ * merges the log back into a few documents per file, which take
+ * COMPACTED_VER so that they sort below anything they didn't replace,
+ * whatever the clocks of the mounts that wrote it.
+ */
+
+#define COMPACTED_VER 0
+
+// Keeps each insert well inside the server's message size limit.
+#define EXTENT_BATCH_BYTES (8 << 20)
+
+static pthread_mutex_t ver_lock = PTHREAD_MUTEX_INITIALIZER;
+static int64_t last_ver = 0;
+
+static int64_t next_version() {
+	struct timespec ts;
+	int64_t ver;
+
+	clock_gettime(CLOCK_REALTIME, &ts);
+	ver = (int64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+	pthread_mutex_lock(&ver_lock);
+	if(ver <= last_ver)
+		ver = last_ver + 1;
+	last_ver = ver;
+	pthread_mutex_unlock(&ver_lock);
+	return ver;
 }
 
-int serialize_extent(struct inode * e, struct elist * list) {
-	mongo * conn = get_conn();
-	bson doc, cond;
-	int res, idx, towrite = 0;
+struct extent_docs {
+	bson * docs;
+	int n;
+	int cap;
+};
+
+static void free_extent_docs(struct extent_docs * d) {
+	int i;
+	for(i = 0; i < d->n; i++)
+		bson_destroy(&d->docs[i]);
+	free(d->docs);
+	d->docs = NULL;
+	d->n = d->cap = 0;
+}
 
-	if(list->nnodes == 0)
-		return 0;
-	qsort(list->list, list->nnodes, sizeof(struct enode), enode_cmp);
-
-	for(idx = 0; idx < list->nnodes;) {
-		bson_oid_t docid;
-		off_t last_end = 0;
-		struct enode * cur = &list->list[idx];
-		const off_t cur_start = cur->off;
-		int nhashes = 0;
-
-		bson_oid_gen(&docid);
-		bson_init(&doc);
-		bson_append_oid(&doc, "_id", &docid);
-		bson_append_oid(&doc, "inode", &e->oid);
-		bson_append_long(&doc, "start", cur->off);
-		bson_append_start_array(&doc, "blocks");
-		towrite = 0;
-		for(; idx < list->nnodes; idx++) {
-			cur = &list->list[idx];
-			char idxstr[10];
-
-			if(last_end > 0 && cur->off != last_end)
+/*
+ * Builds a document for each contiguous run of list, of at most
+ * BLOCKS_PER_EXTENT blocks each.
+ */
+static int build_extent_docs(const bson_oid_t * oid, struct etree * list,
+	int64_t ver, struct extent_docs * out) {
+	struct etree_iter it;
+	struct enode * cur;
+	bson * doc;
+	bson * grown;
+	bson_oid_t docid;
+	off_t last_end = 0;
+	int nhashes = 0;
+	char idxstr[10];
+
+	memset(out, 0, sizeof(*out));
+	for(cur = etree_first(list, &it, 0, MAX_FILE_OFF); cur;
+		cur = etree_next(&it)) {
+		if(nhashes == 0 || cur->off != last_end ||
+			nhashes == BLOCKS_PER_EXTENT) {
+			if(nhashes > 0) {
+				doc = &out->docs[out->n - 1];
+				bson_append_finish_array(doc);
+				bson_append_long(doc, "end", last_end);
+				bson_finish(doc);
+			}
+			if(out->n == out->cap) {
+				out->cap = out->cap ? out->cap * 2 : 16;
+				grown = realloc(out->docs, sizeof(bson) * out->cap);
+				if(!grown) {
+					free_extent_docs(out);
+					return -ENOMEM;
+				}
+				out->docs = grown;
+			}
+			doc = &out->docs[out->n++];
+			bson_oid_gen(&docid);
+			bson_init(doc);
+			bson_append_oid(doc, "_id", &docid);
+			bson_append_oid(doc, "inode", oid);
+			bson_append_long(doc, "ver", ver);
+			bson_append_long(doc, "start", cur->off);
+			bson_append_start_array(doc, "blocks");
+			nhashes = 0;
+		}
+
+		bson_numstr(idxstr, nhashes++);
+		bson_append_start_object(doc, idxstr);
+		if(cur->empty)
+			bson_append_null(doc, "hash");
+		else
+			bson_append_binary(doc, "hash", 0,
+				(const char*)cur->hash, hash_len);
+		bson_append_int(doc, "len", cur->len);
+		if(cur->blkoff > 0)
+			bson_append_int(doc, "off", cur->blkoff);
+		bson_append_finish_object(doc);
+
+		last_end = cur->off + cur->len;
+	}
+	if(nhashes > 0) {
+		bson_append_finish_array(doc);
+		bson_append_long(doc, "end", last_end);
+		bson_finish(doc);
+	}
+	return 0;
+}
+
+static int insert_extent_docs(mongo * conn, struct extent_docs * d) {
+	const bson ** docs;
+	size_t bytes;
+	int first, n, res = 0;
+
+	if((docs = malloc(sizeof(bson*) * d->n)) == NULL)
+		return -ENOMEM;
+	for(first = 0; first < d->n && res == 0; first += n) {
+		bytes = 0;
+		for(n = 0; first + n < d->n; n++) {
+			bytes += bson_size(&d->docs[first + n]);
+			if(n > 0 && bytes > EXTENT_BATCH_BYTES)
 				break;
-			
-			bson_numstr(idxstr, nhashes++);
-			bson_append_start_object(&doc, idxstr);
-			if(cur->empty)
-				bson_append_null(&doc, "hash");
-			else
-				bson_append_binary(&doc, "hash", 0,
-					(const char*)cur->hash, HASH_LEN);
-			bson_append_int(&doc, "len", cur->len);
-			bson_append_finish_object(&doc);
-
-			last_end = cur->off + cur->len;
-			towrite++;
+			docs[n] = &d->docs[first + n];
 		}
-		
-		bson_append_finish_array(&doc);
-		bson_append_long(&doc, "end", last_end);
-		bson_finish(&doc);
-
-		res = mongo_insert(conn, extents_name, &doc, NULL);
-		bson_destroy(&doc);
-		if(res != MONGO_OK) {
-			fprintf(stderr, "Error inserting extent\n");
-			return -EIO;
+		if(mongo_insert_batch(conn, extents_name, docs, n,
+			NULL, 0) != MONGO_OK) {
+			fprintf(stderr, "Error inserting extents: %s\n",
+				conn->lasterrstr);
+			res = -EIO;
 		}
+	}
+	free(docs);
+	return res;
+}
 
-		bson_init(&cond);
-		bson_append_oid(&cond, "inode", &e->oid);
-		bson_append_start_object(&cond, "start");
-		bson_append_long(&cond, "$gte", cur_start);
-		bson_append_finish_object(&cond);
-		bson_append_start_object(&cond, "end");
-		bson_append_long(&cond, "$lte", last_end);
-		bson_append_finish_object(&cond);
-		bson_append_start_object(&cond, "_id");
-		bson_append_oid(&cond, "$lt", &docid);
-		bson_append_finish_object(&cond);
-		bson_finish(&cond);
+int serialize_extent(struct inode * e, struct etree * list) {
+	mongo * conn = get_conn();
+	struct extent_docs docs;
+	struct etree_iter it;
+	struct enode * cur;
+	int64_t ver;
+	int res;
+
+	if(!list || list->nnodes == 0)
+		return 0;
 
-		res = mongo_remove(conn, extents_name, &cond, NULL);
-		bson_destroy(&cond);
+	ver = next_version();
+	if((res = build_extent_docs(&e->oid, list, ver, &docs)) != 0)
+		return res;
+	res = insert_extent_docs(conn, &docs);
+	if(res == 0)
+		note_extent_docs(&e->oid, docs.n);
+	free_extent_docs(&docs);
+	if(res != 0)
+		return res;
 
-		if(res != MONGO_OK) {
-			fprintf(stderr, "Error cleaning up extents\n");
-			return -EIO;
+	// Keep the open file's extent map in sync with what we just wrote,
+	// and remember that this version is ours so it doesn't look like
+	// someone else's write later.
+	if(e->rd_extent) {
+		if(e->rd_nown < RD_OWN_VERS)
+			e->rd_own[e->rd_nown++] = ver;
+		else
+			drop_extent_map(e);
+	}
+	if(e->rd_extent) {
+		for(cur = etree_first(list, &it, 0, MAX_FILE_OFF); cur;
+			cur = etree_next(&it)) {
+			if(insert_enode(&e->rd_extent, cur) != 0) {
+				drop_extent_map(e);
+				break;
+			}
 		}
 	}
 
-	list->nnodes = 0;
+	clear_etree(list);
 	return 0;
 }
 
-int deserialize_extent(struct inode * e, off_t off, size_t len, struct elist ** pout) {
+struct extent_ids {
+	bson_oid_t * ids;
+	int n;
+	int cap;
+};
+
+/* What load_extents found out about the documents it read. */
+struct extent_scan {
+	struct extent_ids ids;
+	int ndocs;
+	int ncompacted;
+	int64_t newest;
+};
+
+static int add_extent_id(struct extent_ids * ids, const bson_oid_t * id) {
+	bson_oid_t * grown;
+
+	if(ids->n == ids->cap) {
+		ids->cap = ids->cap ? ids->cap * 2 : 64;
+		if((grown = realloc(ids->ids, sizeof(bson_oid_t) * ids->cap)) == NULL)
+			return -ENOMEM;
+		ids->ids = grown;
+	}
+	ids->ids[ids->n++] = *id;
+	return 0;
+}
+
+/*
+ * Merges the extent documents of an inode that overlap [off, end) into a
+ * tree. With maxver >= 0, only documents no newer than it are read, and
+ * their ids are collected in scan for compaction.
+ */
+static int load_extents(const bson_oid_t * oid, off_t off, off_t end,
+	int64_t maxver, struct etree ** pout, struct extent_scan * scan) {
 	bson cond;
 	mongo * conn = get_conn();
 	mongo_cursor curs;
-	int res;
-	const off_t end = off + len;
-	struct elist * out = NULL;
+	int err = 0;
+	struct etree * out = NULL;
 
 	/* start <= end && end >= start */
 	bson_init(&cond);
 	bson_append_start_object(&cond, "$query");
-	bson_append_oid(&cond, "inode", &e->oid);
+	bson_append_oid(&cond, "inode", oid);
 	bson_append_start_object(&cond, "start");
-	bson_append_long(&cond, "$lte", off + len);
+	bson_append_long(&cond, "$lte", end);
 	bson_append_finish_object(&cond);
 	bson_append_start_object(&cond, "end");
 	bson_append_long(&cond, "$gte", off);
 	bson_append_finish_object(&cond);
+	if(maxver >= 0) {
+		// Documents without a version are older than any that have one.
+		bson_append_start_object(&cond, "ver");
+		bson_append_start_object(&cond, "$not");
+		bson_append_long(&cond, "$gt", maxver);
+		bson_append_finish_object(&cond);
+		bson_append_finish_object(&cond);
+	}
 	bson_append_finish_object(&cond);
+	// Extents are applied oldest first so newer ones overwrite them.
 	bson_append_start_object(&cond, "$orderby");
-	bson_append_int(&cond, "start", 1);
+	bson_append_int(&cond, "ver", 1);
 	bson_append_int(&cond, "_id", 1);
 	bson_append_finish_object(&cond);
 	bson_finish(&cond);
@@ -194,12 +537,14 @@ int deserialize_extent(struct inode * e, off_t off, size_t len, struct elist **
 	mongo_cursor_init(&curs, conn, extents_name);
 	mongo_cursor_set_query(&curs, &cond);
 
-	while((res = mongo_cursor_next(&curs)) == MONGO_OK) {
+	while(err == 0 && mongo_cursor_next(&curs) == MONGO_OK) {
 		const bson * curdoc = mongo_cursor_bson(&curs);
 		bson_iterator topi, i, sub;
 		bson_type bt;
 		off_t curoff = 0;
 		const char * key;
+		if(scan)
+			scan->ndocs++;
 		bson_iterator_init(&topi, curdoc);
 		while(bson_iterator_next(&topi) != 0) {
 			key = bson_iterator_key(&topi);
@@ -207,24 +552,41 @@ int deserialize_extent(struct inode * e, off_t off, size_t len, struct elist **
 				bson_iterator_subiterator(&topi, &i);
 			else if(strcmp(key, "start") == 0)
 				curoff = bson_iterator_long(&topi);
+			else if(scan && maxver >= 0 && strcmp(key, "_id") == 0)
+				err = add_extent_id(&scan->ids, bson_iterator_oid(&topi));
+			else if(scan && strcmp(key, "ver") == 0) {
+				int64_t ver = bson_iterator_long(&topi);
+				if(ver == COMPACTED_VER)
+					scan->ncompacted++;
+				if(ver > scan->newest)
+					scan->newest = ver;
+			}
 		}
 
-		while(bson_iterator_next(&i) != 0) {
+		while(err == 0 && bson_iterator_next(&i) != 0) {
 			bson_iterator_subiterator(&i, &sub);
+			struct enode node;
 			uint8_t * hash = NULL;
+			int hashlen = 0;
 			int curlen = 0;
 			off_t curend;
 			int empty = 0;
+
+			memset(&node, 0, sizeof(node));
 			while((bt = bson_iterator_next(&sub)) != 0) {
 				key = bson_iterator_key(&sub);
 				if(strcmp(key, "hash") == 0) {
 					if(bt == BSON_NULL)
 						empty = 1;
-					else
+					else {
 						hash = (uint8_t*)bson_iterator_bin_data(&sub);
+						hashlen = bson_iterator_bin_len(&sub);
+					}
 				}
 				else if(strcmp(key, "len") == 0)
 					curlen = bson_iterator_int(&sub);
+				else if(strcmp(key, "off") == 0)
+					node.blkoff = bson_iterator_int(&sub);
 			}
 
 			curend = curoff + curlen;
@@ -233,20 +595,298 @@ int deserialize_extent(struct inode * e, off_t off, size_t len, struct elist **
 				continue;
 			}
 
-			if(empty)
-				res = insert_empty(&out, curoff, curlen);
-			else
-				res = insert_hash(&out, curoff, curlen, hash);
-			if(res != 0) {
+			node.off = curoff;
+			node.len = curlen;
+			node.empty = empty;
+			if(!empty)
+				memcpy(node.hash, hash,
+					hashlen < HASH_LEN ? hashlen : HASH_LEN);
+			if((err = insert_enode(&out, &node)) != 0)
 				fprintf(stderr, "Error adding hash to extent tree\n");
-				return res;
-			}
 			curoff += curlen;
 		}
 	}
+	// Compacting from a partial read would lose whatever wasn't read.
+	if(err == 0 && maxver >= 0 && curs.err != MONGO_CURSOR_EXHAUSTED) {
+		fprintf(stderr, "Error reading extents to compact\n");
+		err = -EIO;
+	}
 	mongo_cursor_destroy(&curs);
 	bson_destroy(&cond);
+	if(err != 0) {
+		free_etree(out);
+		return err;
+	}
 	*pout = out;
 
 	return 0;
 }
+
+static int read_extents(struct inode * e, off_t off, size_t len,
+	struct etree ** pout, int64_t * newest) {
+	struct extent_scan scan;
+	int res;
+
+	memset(&scan, 0, sizeof(scan));
+	if((res = load_extents(&e->oid, off, off + len, -1, pout, &scan)) != 0)
+		return res;
+	// Logs that grew under other mounts get compacted too.
+	note_extent_count(&e->oid, scan.ndocs - scan.ncompacted);
+	if(newest)
+		*newest = scan.newest;
+	return 0;
+}
+
+int deserialize_extent(struct inode * e, off_t off, size_t len, struct etree ** pout) {
+	return read_extents(e, off, len, pout, NULL);
+}
+
+/*
+ * Drops a file's extent map if it was truncated, or if anyone else has
+ * written extents for it since the map was loaded, which shows up as
+ * versions newer than the map that this handle didn't write. The query
+ * runs without wr_lock, so reads and writes carry on meanwhile, and its
+ * answer is only used if the map wasn't reloaded in the meantime.
+ */
+void check_extent_map(struct inode * e, int truncated) {
+	mongo * conn = get_conn();
+	mongo_cursor curs;
+	bson query, fields;
+	bson_iterator i;
+	// Only RD_OWN_VERS of them can be ours, so any more is a change.
+	int64_t vers[RD_OWN_VERS + 1], since, newest;
+	int nvers = 0, n, k, mapped, changed = 0;
+
+	pthread_mutex_lock(&e->wr_lock);
+	if(truncated)
+		drop_extent_map(e);
+	mapped = e->rd_extent != NULL;
+	since = e->rd_ver;
+	pthread_mutex_unlock(&e->wr_lock);
+	if(!mapped)
+		return;
+
+	bson_init(&query);
+	bson_append_oid(&query, "inode", &e->oid);
+	bson_append_start_object(&query, "ver");
+	bson_append_long(&query, "$gt", since);
+	bson_append_finish_object(&query);
+	bson_finish(&query);
+	bson_init(&fields);
+	bson_append_int(&fields, "ver", 1);
+	bson_finish(&fields);
+
+	mongo_cursor_init(&curs, conn, extents_name);
+	mongo_cursor_set_query(&curs, &query);
+	mongo_cursor_set_fields(&curs, &fields);
+	while(!changed && mongo_cursor_next(&curs) == MONGO_OK) {
+		if(bson_find(&i, mongo_cursor_bson(&curs), "ver") != BSON_LONG)
+			continue;
+		if(nvers == RD_OWN_VERS + 1)
+			changed = 1;
+		else
+			vers[nvers++] = bson_iterator_long(&i);
+	}
+	// If we can't tell, assume the worst.
+	if(!changed && curs.err != MONGO_CURSOR_EXHAUSTED)
+		changed = 1;
+	mongo_cursor_destroy(&curs);
+	bson_destroy(&query);
+	bson_destroy(&fields);
+
+	pthread_mutex_lock(&e->wr_lock);
+	if(!e->rd_extent || e->rd_ver != since) {
+		pthread_mutex_unlock(&e->wr_lock);
+		return;
+	}
+	newest = since;
+	for(k = 0; !changed && k < nvers; k++) {
+		for(n = 0; n < e->rd_nown && e->rd_own[n] != vers[k]; n++);
+		if(n == e->rd_nown)
+			changed = 1;
+		else if(vers[k] > newest)
+			newest = vers[k];
+	}
+	if(changed)
+		drop_extent_map(e);
+	else {
+		// Versions we wrote after the query still need recognizing.
+		e->rd_ver = newest;
+		for(n = k = 0; n < e->rd_nown; n++) {
+			if(e->rd_own[n] > newest)
+				e->rd_own[k++] = e->rd_own[n];
+		}
+		e->rd_nown = k;
+	}
+	pthread_mutex_unlock(&e->wr_lock);
+}
+
+/* Counts extent documents, in whatever database extents_name is in. */
+static int count_extents(mongo * conn, const bson * cond) {
+	const char * coll = strchr(extents_name, '.');
+	char * db;
+	double n;
+
+	if(!coll)
+		return -EINVAL;
+	if((db = strndup(extents_name, coll - extents_name)) == NULL)
+		return -ENOMEM;
+	n = mongo_count(conn, db, coll + 1, cond);
+	free(db);
+	return n < 0 ? -EIO : (int)n;
+}
+
+static int remove_extent_ids(mongo * conn, const bson_oid_t * ids, int n) {
+	bson cond;
+	char idxstr[12];
+	int i, res;
+
+	bson_init(&cond);
+	bson_append_start_object(&cond, "_id");
+	bson_append_start_array(&cond, "$in");
+	for(i = 0; i < n; i++) {
+		bson_numstr(idxstr, i);
+		bson_append_oid(&cond, idxstr, &ids[i]);
+	}
+	bson_append_finish_array(&cond);
+	bson_append_finish_object(&cond);
+	bson_finish(&cond);
+	res = mongo_remove(conn, extents_name, &cond, NULL);
+	bson_destroy(&cond);
+	return res == MONGO_OK ? 0 : -EIO;
+}
+
+/*
+ * Rewrites the extent documents of an inode that are no newer than
+ * maxver as a few large ones. The new documents take COMPACTED_VER, so
+ * any document that wasn't read still applies on top of them, even one
+ * from a mount whose clock is behind and which arrives while this runs.
+ *
+ * If any of the old documents disappear while this runs, the file was
+ * truncated or removed, or another mount compacted it first; and if
+ * compacted documents show up that we didn't write, another mount is
+ * compacting it too. Either way the new documents are removed again, so
+ * at most one set of compacted documents survives.
+ */
+int compact_extents(const bson_oid_t * oid, int64_t maxver) {
+	mongo * conn = get_conn();
+	struct etree * merged = NULL;
+	struct extent_scan scan;
+	struct extent_ids * old = &scan.ids;
+	struct extent_ids added;
+	struct extent_docs docs;
+	bson cond;
+	char idxstr[12];
+	int i, n, res;
+
+	memset(&scan, 0, sizeof(scan));
+	memset(&added, 0, sizeof(added));
+	memset(&docs, 0, sizeof(docs));
+	if((res = load_extents(oid, 0, MAX_FILE_OFF, maxver, &merged,
+		&scan)) != 0)
+		goto done;
+	// Files whose documents can't be merged any further are still
+	// rewritten once, so that they stop counting as uncompacted.
+	if(!merged || merged->nnodes == 0 || scan.ncompacted == old->n)
+		goto done;
+	if((res = build_extent_docs(oid, merged, COMPACTED_VER, &docs)) != 0)
+		goto done;
+
+	for(i = 0; i < docs.n; i++) {
+		bson_iterator it;
+		bson_find(&it, &docs.docs[i], "_id");
+		if((res = add_extent_id(&added, bson_iterator_oid(&it))) != 0)
+			goto done;
+	}
+	if((res = insert_extent_docs(conn, &docs)) != 0)
+		goto done;
+
+	bson_init(&cond);
+	bson_append_start_object(&cond, "_id");
+	bson_append_start_array(&cond, "$in");
+	for(i = 0; i < old->n; i++) {
+		bson_numstr(idxstr, i);
+		bson_append_oid(&cond, idxstr, &old->ids[i]);
+	}
+	bson_append_finish_array(&cond);
+	bson_append_finish_object(&cond);
+	bson_finish(&cond);
+	i = count_extents(conn, &cond);
+	bson_destroy(&cond);
+
+	bson_init(&cond);
+	bson_append_oid(&cond, "inode", oid);
+	bson_append_long(&cond, "ver", COMPACTED_VER);
+	bson_finish(&cond);
+	n = count_extents(conn, &cond);
+	bson_destroy(&cond);
+
+	if(i != old->n || n != scan.ncompacted + added.n) {
+		remove_extent_ids(conn, added.ids, added.n);
+		res = -EAGAIN;
+	} else if((res = remove_extent_ids(conn, old->ids, old->n)) != 0)
+		fprintf(stderr, "Error removing compacted extents\n");
+
+done:
+	free_etree(merged);
+	free_extent_docs(&docs);
+	free(old->ids);
+	free(added.ids);
+	return res;
+}
+
+/* Must be called with wr_lock held. */
+void drop_extent_map(struct inode * e) {
+	free_etree(e->rd_extent);
+	e->rd_extent = NULL;
+	e->rd_nomap = 0;
+}
+
+/*
+ * Like deserialize_extent, but answers from the open file's in-memory
+ * extent map, loading the whole map on first use. Files too large to map
+ * fall back to querying the range.
+ */
+int map_extent(struct inode * e, off_t off, size_t len, struct etree ** pout) {
+	struct etree * out = NULL;
+	struct etree_iter it;
+	struct enode * cur;
+	int res = 0;
+
+	pthread_mutex_lock(&e->wr_lock);
+	if(!e->rd_extent && !e->rd_nomap) {
+		if((res = read_extents(e, 0, e->size, &e->rd_extent,
+			&e->rd_ver)) != 0) {
+			pthread_mutex_unlock(&e->wr_lock);
+			return res;
+		}
+		e->rd_nown = 0;
+		if(!e->rd_extent && (e->rd_extent = init_etree()) == NULL) {
+			pthread_mutex_unlock(&e->wr_lock);
+			return -ENOMEM;
+		}
+		if(e->rd_extent->nnodes > EXTENT_MAP_LIMIT) {
+			drop_extent_map(e);
+			e->rd_nomap = 1;
+		}
+	}
+
+	if(!e->rd_extent) {
+		pthread_mutex_unlock(&e->wr_lock);
+		return deserialize_extent(e, off, len, pout);
+	}
+
+	for(cur = etree_first(e->rd_extent, &it, off, off + len); cur;
+		cur = etree_next(&it)) {
+		if((res = insert_enode(&out, cur)) != 0)
+			break;
+	}
+	pthread_mutex_unlock(&e->wr_lock);
+
+	if(res != 0) {
+		free_etree(out);
+		return res;
+	}
+	*pout = out;
+	return 0;
+}
@@ -0,0 +1,189 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <mongo.h>
+#include "mongo-fuse.h"
+#ifdef __APPLE__
+#include <CommonCrypto/CommonDigest.h>
+#else
+#include <openssl/sha.h>
+#endif
+#ifdef HAVE_BLAKE3
+#include <blake3.h>
+#endif
+
+/*
+ * Block hashes. Blocks are keyed by the hash of their contents, so every
+ * mount of a filesystem has to use the same algorithm; the one in use is
+ * recorded in the config collection the first time the filesystem is
+ * mounted, and that record wins over the hash option from then on.
+ * Filesystems from before the record existed are all SHA1.
+ *
+ * Hashes are stored in HASH_LEN-byte arrays whatever the algorithm, padded
+ * with zeros, so they can be compared and copied whole in memory. Only
+ * the first hash_len bytes go to and from the database.
+ *
+ * SHA-256 comes from OpenSSL or CommonCrypto, which use the SHA extensions
+ * where the CPU has them. BLAKE3 is available when built with HAVE_BLAKE3
+ * against the reference C library, which picks the widest SIMD the CPU
+ * supports at runtime.
+ */
+
+struct hash_algo {
+    const char * name;
+    int len;
+    void (*fn)(const char * buf, size_t size, uint8_t * out);
+};
+
+extern char * config_name;
+extern char * blocks_name;
+
+int hash_len = 20;
+
+static void sha1_block(const char * buf, size_t size, uint8_t * out) {
+#ifdef __APPLE__
+    CC_SHA1(buf, size, out);
+#else
+    SHA1((const unsigned char*)buf, size, out);
+#endif
+}
+
+static void sha256_block(const char * buf, size_t size, uint8_t * out) {
+#ifdef __APPLE__
+    CC_SHA256(buf, size, out);
+#else
+    SHA256((const unsigned char*)buf, size, out);
+#endif
+}
+
+#ifdef HAVE_BLAKE3
+static void blake3_block(const char * buf, size_t size, uint8_t * out) {
+    blake3_hasher hasher;
+    blake3_hasher_init(&hasher);
+    blake3_hasher_update(&hasher, buf, size);
+    blake3_hasher_finalize(&hasher, out, BLAKE3_OUT_LEN);
+}
+#endif
+
+static const struct hash_algo algos[] = {
+    { "sha1", 20, sha1_block },
+    { "sha256", 32, sha256_block },
+#ifdef HAVE_BLAKE3
+    { "blake3", 32, blake3_block },
+#endif
+    { NULL, 0, NULL }
+};
+
+static const struct hash_algo * algo = &algos[0];
+static int algo_chosen = 0;
+
+static const struct hash_algo * find_algo(const char * name) {
+    const struct hash_algo * a;
+    for(a = algos; a->name; a++) {
+        if(strcmp(a->name, name) == 0)
+            return a;
+    }
+    return NULL;
+}
+
+/* Picks the algorithm for a new filesystem. */
+int setup_hash(const char * name) {
+    const struct hash_algo * a = find_algo(name);
+
+    if(!a) {
+        fprintf(stderr, "Unknown or unsupported hash %s\n", name);
+        return -EINVAL;
+    }
+    algo = a;
+    hash_len = a->len;
+    algo_chosen = 1;
+    return 0;
+}
+
+void hash_block(const char * buf, size_t size, uint8_t hash[HASH_LEN]) {
+    algo->fn(buf, size, hash);
+    memset(hash + algo->len, 0, HASH_LEN - algo->len);
+}
+
+static int record_hash(mongo * conn) {
+    bson cond, doc;
+    int res;
+
+    bson_init(&cond);
+    bson_append_string(&cond, "_id", "hash");
+    bson_finish(&cond);
+
+    bson_init(&doc);
+    bson_append_string(&doc, "_id", "hash");
+    bson_append_string(&doc, "algorithm", algo->name);
+    bson_finish(&doc);
+
+    res = mongo_update(conn, config_name, &cond, &doc,
+        MONGO_UPDATE_UPSERT, NULL);
+    bson_destroy(&cond);
+    bson_destroy(&doc);
+    if(res != MONGO_OK) {
+        fprintf(stderr, "Error recording block hash: %s\n",
+            mongo_get_server_err_string(conn));
+        return -EIO;
+    }
+    return 0;
+}
+
+/*
+ * Switches to the algorithm recorded for this filesystem, recording the
+ * chosen one if there isn't a record yet.
+ */
+int load_hash_config() {
+    mongo * conn = get_conn();
+    const struct hash_algo * a;
+    bson query, fields, doc;
+    bson_iterator i;
+    int res;
+
+    bson_init(&query);
+    bson_append_string(&query, "_id", "hash");
+    bson_finish(&query);
+    res = mongo_find_one(conn, config_name, &query, NULL, &doc);
+    bson_destroy(&query);
+
+    if(res == MONGO_OK) {
+        if(bson_find(&i, &doc, "algorithm") != BSON_STRING) {
+            fprintf(stderr, "Bad block hash record in %s\n", config_name);
+            bson_destroy(&doc);
+            return -EIO;
+        }
+        if((a = find_algo(bson_iterator_string(&i))) == NULL) {
+            fprintf(stderr, "Filesystem uses %s hashes, which this build "
+                "doesn't support\n", bson_iterator_string(&i));
+            bson_destroy(&doc);
+            return -EINVAL;
+        }
+        bson_destroy(&doc);
+        if(algo_chosen && a != algo)
+            fprintf(stderr, "Filesystem uses %s hashes, ignoring hash=%s\n",
+                a->name, algo->name);
+        algo = a;
+        hash_len = a->len;
+        return 0;
+    }
+
+    // Any blocks already stored without a record are SHA1.
+    if(algo != &algos[0]) {
+        bson_init(&fields);
+        bson_append_int(&fields, "_id", 1);
+        bson_finish(&fields);
+        res = mongo_find_one(conn, blocks_name, bson_shared_empty(),
+            &fields, &doc);
+        bson_destroy(&fields);
+        if(res == MONGO_OK) {
+            bson_destroy(&doc);
+            fprintf(stderr, "Filesystem already has SHA1 blocks, "
+                "ignoring hash=%s\n", algo->name);
+            algo = &algos[0];
+            hash_len = algo->len;
+        }
+    }
+    return record_hash(conn);
+}
@@ -16,7 +16,50 @@
 #include <execinfo.h>
 
 extern const char * inodes_name;
+extern const char * extents_name;
 extern const char * locks_name;
+extern char * config_name;
+
+static bson attr_fields, listing_fields;
+static pthread_once_t fields_once = PTHREAD_ONCE_INIT;
+
+static void append_attr_fields(bson * b) {
+    // Symlinks are the only inodes with data, and it's just their target.
+    static const char * names[] = { "mode", "owner", "group", "size",
+        "created", "modified", "nlink", "data", NULL };
+    const char ** name;
+    for(name = names; *name; name++)
+        bson_append_int(b, *name, 1);
+}
+
+static void init_fields() {
+    bson_init(&attr_fields);
+    append_attr_fields(&attr_fields);
+    bson_finish(&attr_fields);
+
+    bson_init(&listing_fields);
+    append_attr_fields(&listing_fields);
+    bson_append_int(&listing_fields, "dirents", 1);
+    bson_finish(&listing_fields);
+}
+
+/*
+ * Field selectors for reading inodes. FIELDS_ATTRS is enough for getattr,
+ * access and readlink, and leaves out the dirents array, which can be
+ * large for heavily hard-linked files; FIELDS_LISTING adds dirents back
+ * for readdir. Anything that will commit the inode reads FIELDS_ALL.
+ */
+const bson * inode_fields(int which) {
+    pthread_once(&fields_once, init_fields);
+    switch(which) {
+    case FIELDS_ATTRS:
+        return &attr_fields;
+    case FIELDS_LISTING:
+        return &listing_fields;
+    default:
+        return bson_shared_empty();
+    }
+}
 
 int inode_exists(const char * path) {
     bson query, fields;
@@ -29,8 +72,7 @@ int inode_exists(const char * path) {
     bson_finish(&query);
 
     bson_init(&fields);
-    bson_append_int(&fields, "dirents", 1);
-    bson_append_int(&fields, "_id", 0);
+    bson_append_int(&fields, "_id", 1);
     bson_finish(&fields);
 
     mongo_cursor_init(&curs, conn, inodes_name);
@@ -50,6 +92,223 @@ int inode_exists(const char * path) {
     return -ENOENT;
 }
 
+/*
+ * Returns the length of the part of path naming its parent directory, or
+ * 0 for the root, which has no parent.
+ */
+size_t parent_len(const char * path, size_t len) {
+    while(len > 0 && path[len - 1] != '/')
+        len--;
+    if(len <= 1)
+        return path[0] == '/' && path[1] != '\0' ? 1 : 0;
+    return len - 1;
+}
+
+/*
+ * Each inode keeps the parent directory of each of its dirents in an
+ * indexed "parents" array, so listing a directory is an exact match
+ * rather than a regex over the paths of everything under it.
+ */
+static void append_parents(bson * doc, struct inode * e) {
+    struct dirent * cde;
+    char istr[16];
+    size_t plen;
+    int n = 0;
+
+    bson_append_start_array(doc, "parents");
+    for(cde = e->dirents; cde; cde = cde->next) {
+        if((plen = parent_len(cde->path, cde->len)) == 0)
+            continue;
+        bson_numstr(istr, n++);
+        bson_append_string_n(doc, istr, cde->path, plen);
+    }
+    bson_append_finish_array(doc);
+}
+
+int ensure_indexes() {
+    mongo * conn = get_conn();
+    bson key;
+    int res;
+
+    if(mongo_create_simple_index(conn, inodes_name, "dirents", 0, NULL) != MONGO_OK ||
+        mongo_create_simple_index(conn, inodes_name, "parents", 0, NULL) != MONGO_OK) {
+        fprintf(stderr, "Error creating inode indexes %s\n",
+            mongo_get_server_err_string(conn));
+        return -EIO;
+    }
+
+    // Extents are read in version order, which would otherwise be an
+    // in-memory sort of every document a file has.
+    bson_init(&key);
+    bson_append_int(&key, "inode", 1);
+    bson_append_int(&key, "ver", 1);
+    bson_append_int(&key, "_id", 1);
+    bson_finish(&key);
+    res = mongo_create_index(conn, extents_name, &key, NULL, 0, NULL);
+    bson_destroy(&key);
+    if(res != MONGO_OK) {
+        fprintf(stderr, "Error creating extent index %s\n",
+            mongo_get_server_err_string(conn));
+        return -EIO;
+    }
+    return 0;
+}
+
+/*
+ * Databases record the version of the inode format they've been migrated
+ * to in the config collection. Version 1 added the parents field.
+ */
+#define SCHEMA_VERSION 1
+
+static int record_schema(mongo * conn) {
+    bson cond, doc;
+    int res;
+
+    bson_init(&cond);
+    bson_append_string(&cond, "_id", "schema");
+    bson_finish(&cond);
+
+    bson_init(&doc);
+    bson_append_string(&doc, "_id", "schema");
+    bson_append_int(&doc, "version", SCHEMA_VERSION);
+    bson_finish(&doc);
+
+    res = mongo_update(conn, config_name, &cond, &doc,
+        MONGO_UPDATE_UPSERT, NULL);
+    bson_destroy(&cond);
+    bson_destroy(&doc);
+    if(res != MONGO_OK) {
+        fprintf(stderr, "Error recording schema version: %s\n",
+            mongo_get_server_err_string(conn));
+        return -EIO;
+    }
+    return 0;
+}
+
+/*
+ * Refuses to mount a database that needs migrating first. Databases
+ * without a schema record are either new or from before there was one,
+ * so they're checked for inodes without parents and recorded if there
+ * are none.
+ */
+int check_schema() {
+    mongo * conn = get_conn();
+    bson query, fields, doc;
+    bson_iterator i;
+    int version = 0, res;
+
+    bson_init(&query);
+    bson_append_string(&query, "_id", "schema");
+    bson_finish(&query);
+    res = mongo_find_one(conn, config_name, &query, NULL, &doc);
+    bson_destroy(&query);
+    if(res == MONGO_OK) {
+        if(bson_find(&i, &doc, "version") == BSON_INT)
+            version = bson_iterator_int(&i);
+        bson_destroy(&doc);
+        if(version > SCHEMA_VERSION) {
+            fprintf(stderr, "Filesystem schema version %d is newer than "
+                "this build supports\n", version);
+            return -EINVAL;
+        }
+    }
+    if(version == SCHEMA_VERSION)
+        return 0;
+
+    bson_init(&query);
+    bson_append_start_object(&query, "parents");
+    bson_append_bool(&query, "$exists", 0);
+    bson_append_finish_object(&query);
+    bson_finish(&query);
+    bson_init(&fields);
+    bson_append_int(&fields, "_id", 1);
+    bson_finish(&fields);
+    res = mongo_find_one(conn, inodes_name, &query, &fields, &doc);
+    bson_destroy(&query);
+    bson_destroy(&fields);
+    if(res == MONGO_OK) {
+        bson_destroy(&doc);
+        fprintf(stderr, "Filesystem needs migrating before it can be "
+            "mounted; run once with -o migrate\n");
+        return -EINVAL;
+    }
+    return record_schema(conn);
+}
+
+/*
+ * Adds the parents field to inodes written before it existed. This is
+ * run once against an existing database with -o migrate, before it's
+ * mounted by a version that lists directories by parent.
+ */
+int migrate_parents() {
+    bson query, fields, cond, doc;
+    mongo * conn = get_conn();
+    mongo_cursor curs;
+    unsigned long migrated = 0;
+    int res = 0;
+
+    bson_init(&query);
+    bson_append_start_object(&query, "parents");
+    bson_append_bool(&query, "$exists", 0);
+    bson_append_finish_object(&query);
+    bson_finish(&query);
+
+    bson_init(&fields);
+    bson_append_int(&fields, "dirents", 1);
+    bson_finish(&fields);
+
+    mongo_cursor_init(&curs, conn, inodes_name);
+    mongo_cursor_set_query(&curs, &query);
+    mongo_cursor_set_fields(&curs, &fields);
+
+    while(mongo_cursor_next(&curs) == MONGO_OK) {
+        struct inode e;
+        init_inode(&e);
+        if((res = read_inode(mongo_cursor_bson(&curs), &e)) != 0) {
+            free_inode(&e);
+            break;
+        }
+
+        bson_init(&cond);
+        bson_append_oid(&cond, "_id", &e.oid);
+        bson_finish(&cond);
+
+        bson_init(&doc);
+        bson_append_start_object(&doc, "$set");
+        append_parents(&doc, &e);
+        bson_append_int(&doc, "nlink", e.direntcount);
+        bson_append_finish_object(&doc);
+        bson_finish(&doc);
+
+        if(mongo_update(conn, inodes_name, &cond, &doc,
+            MONGO_UPDATE_BASIC, NULL) != MONGO_OK) {
+            fprintf(stderr, "Error migrating inode %s\n",
+                mongo_get_server_err_string(conn));
+            res = -EIO;
+        }
+        bson_destroy(&cond);
+        bson_destroy(&doc);
+        free_inode(&e);
+        if(res != 0)
+            break;
+        migrated++;
+    }
+    if(res == 0 && curs.err != MONGO_CURSOR_EXHAUSTED) {
+        fprintf(stderr, "Error listing inodes to migrate\n");
+        res = -EIO;
+    }
+    mongo_cursor_destroy(&curs);
+    bson_destroy(&query);
+    bson_destroy(&fields);
+
+    fprintf(stderr, "Added parents to %lu inodes\n", migrated);
+    if(res == 0)
+        res = ensure_indexes();
+    if(res == 0)
+        res = record_schema(conn);
+    return res;
+}
+
 int commit_inode(struct inode * e) {
     bson cond, doc;
     mongo * conn = get_conn();
@@ -67,7 +326,10 @@ int commit_inode(struct inode * e) {
         cde = cde->next;
     }
     bson_append_finish_array(&doc);
+    append_parents(&doc, e);
 
+    // Stored separately so getattr doesn't need the dirents to count them.
+    bson_append_int(&doc, "nlink", e->direntcount);
     bson_append_int(&doc, "mode", e->mode);
     bson_append_long(&doc, "owner", e->owner);
     bson_append_long(&doc, "group", e->group);
@@ -87,6 +349,7 @@ int commit_inode(struct inode * e) {
         MONGO_UPDATE_UPSERT, NULL);
     bson_destroy(&cond);
     bson_destroy(&doc);
+    meta_cache_invalidate_inode(e);
     if(res != MONGO_OK) {
         fprintf(stderr, "Error committing inode %s\n",
             mongo_get_server_err_string(conn));
@@ -98,6 +361,8 @@ int commit_inode(struct inode * e) {
 void init_inode(struct inode * e) {
     memset(e, 0, sizeof(struct inode));
     pthread_mutex_init(&e->wr_lock, NULL);
+    pthread_cond_init(&e->wb_cond, NULL);
+    pthread_mutex_init(&e->stage_lock, NULL);
 }
 
 int read_inode(const bson * doc, struct inode * out) {
@@ -122,6 +387,8 @@ int read_inode(const bson * doc, struct inode * out) {
             out->created = bson_iterator_time_t(&i);
         else if(strcmp(key, "modified") == 0)
             out->modified = bson_iterator_time_t(&i);
+        else if(strcmp(key, "nlink") == 0 && !out->dirents)
+            out->direntcount = bson_iterator_int(&i);
         else if(strcmp(key, "data") == 0) {
             out->datalen = bson_iterator_string_len(&i);
             out->data = malloc(out->datalen + 1);
@@ -133,6 +400,7 @@ int read_inode(const bson * doc, struct inode * out) {
                 free(out->dirents);
                 out->dirents = next;
             }
+            out->direntcount = 0;
             bson_iterator_subiterator(&i, &sub);
             while((bt = bson_iterator_next(&sub)) > 0) {
                 int len = bson_iterator_string_len(&sub);
@@ -151,57 +419,92 @@ int read_inode(const bson * doc, struct inode * out) {
     return 0;
 }
 
-int get_inode_impl(const char * path, struct inode * out) {
-    bson query, doc;
+static int find_inode(const bson * query, struct inode * out, int fields) {
+    bson doc;
     int res;
     mongo * conn = get_conn();
 
+    res = mongo_find_one(conn, inodes_name, query,
+         inode_fields(fields), &doc);
+    if(res != MONGO_OK)
+        return -ENOENT;
+
+    res = read_inode(&doc, out);
+    bson_destroy(&doc);
+    return res;
+}
+
+int get_inode_impl(const char * path, struct inode * out, int fields) {
+    bson query;
+    int res;
+
     bson_init(&query);
     bson_append_string(&query, "dirents", path);
     bson_finish(&query);
 
-    res = mongo_find_one(conn, inodes_name, &query,
-         bson_shared_empty(), &doc);
+    res = find_inode(&query, out, fields);
+    bson_destroy(&query);
+    return res;
+}
 
-    if(res != MONGO_OK) {
-        bson_destroy(&query);
-        return -ENOENT;
-    }
+static int get_inode_oid_impl(const bson_oid_t * oid, struct inode * out,
+    int fields) {
+    bson query;
+    int res;
 
-    bson_destroy(&query);
-    res = read_inode(&doc, out);
-    bson_destroy(&doc);
+    bson_init(&query);
+    bson_append_oid(&query, "_id", oid);
+    bson_finish(&query);
 
+    res = find_inode(&query, out, fields);
+    bson_destroy(&query);
     return res;
 }
 
 int get_cached_inode(const char * path, struct inode * out) {
     time_t now = time(NULL);
+    uint64_t db_size = out->db_size;
     int res;
     if(now - out->updated < 3)
         return 0;
 
-    res = get_inode_impl(path, out);
-    if(res == 0)
-        out->updated = now;
-    return res;
+    // Open files are refreshed by id, so they keep working if they're
+    // renamed while open.
+    res = get_inode_oid_impl(&out->oid, out, FIELDS_ALL);
+    if(res != 0)
+        return res;
+    out->updated = now;
+    out->db_size = out->size;
+
+    // Someone else may have written to the file since we loaded its
+    // extent map, or truncated it, which removes extents without writing
+    // any.
+    check_extent_map(out, out->size < db_size);
+    return 0;
 }
 
 int get_inode(const char * path, struct inode * out) {
     init_inode(out);
-    return get_inode_impl(path, out);
+    return get_inode_impl(path, out, FIELDS_ALL);
+}
+
+int get_inode_by_oid(const bson_oid_t * oid, struct inode * out, int fields) {
+    init_inode(out);
+    return get_inode_oid_impl(oid, out, fields);
 }
 
 int check_access(struct inode * e, int amode) {
-    const struct fuse_context * fcx = fuse_get_context();
     mode_t mode = e->mode;
+    uid_t uid;
+    gid_t gid;
 
-    if(fcx->uid == 0 || amode == 0)
+    get_caller(&uid, &gid);
+    if(uid == 0 || amode == 0)
         return 0;
 
-    if(fcx->uid == e->owner)
+    if(uid == e->owner)
         mode >>= 6;
-    else if(fcx->gid == e->group)
+    else if(gid == e->group)
         mode >>= 3;
 
     return (((mode & S_IRWXO) & amode) == 0);
@@ -210,7 +513,8 @@ int check_access(struct inode * e, int amode) {
 int create_inode(const char * path, mode_t mode, const char * data) {
     struct inode e;
     int pathlen = strlen(path);
-    const struct fuse_context * fcx = fuse_get_context();
+    uid_t uid;
+    gid_t gid;
     int res;
 
     res = inode_exists(path);
@@ -228,9 +532,10 @@ int create_inode(const char * path, mode_t mode, const char * data) {
     e.dirents->next = NULL;
     e.direntcount = 1;
 
+    get_caller(&uid, &gid);
     e.mode = mode;
-    e.owner = fcx->uid;
-    e.group = fcx->gid;
+    e.owner = uid;
+    e.group = gid;
     e.created = time(NULL);
     e.modified = time(NULL);
     if(data) {
@@ -251,6 +556,12 @@ int create_inode(const char * path, mode_t mode, const char * data) {
 }
 
 void free_inode(struct inode *e) {
+    // This waits out the stage timer, which may be flushing the inode's
+    // extents, and keeps it from finding the inode again.
+    if(e->stage) {
+        drop_stage(e);
+        free(e->stage);
+    }
     if(e->data)
         free(e->data);
     while(e->dirents) {
@@ -258,6 +569,7 @@ void free_inode(struct inode *e) {
         free(e->dirents);
         e->dirents = next;
     }
-    if(e->wr_extent)
-        free(e->wr_extent);
+    drop_queued_extents(e);
+    free_etree(e->wr_extent);
+    free_etree(e->rd_extent);
 }
@@ -0,0 +1,929 @@
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#include <stdlib.h>
+#include <limits.h>
+#include <pthread.h>
+#include <sys/stat.h>
+#include <mongo.h>
+#include "mongo-fuse.h"
+#include <osxfuse/fuse_lowlevel.h>
+
+/*
+ * Low-level FUSE operations, used with -o lowlevel. The kernel refers to
+ * files by inode number here rather than by path, so it only has to look
+ * a name up once and can cache the answer for the entry timeout, instead
+ * of every operation resolving its path against the dirents again.
+ *
+ * Inode numbers come from a hash of the inode's _id, and a table maps
+ * them back to the _id and to the path each was last looked up by. The
+ * kernel counts lookups of each inode number and tells us with forget
+ * when it's done with one, which is when it leaves the table. Operations
+ * on an inode by itself (getattr, open) go straight to the _id; the ones
+ * that change the namespace turn it back into a path and reuse the
+ * path-based operations.
+ */
+
+#define NODE_BUCKETS 65536
+#ifndef FUSE_UNKNOWN_INO
+#define FUSE_UNKNOWN_INO 0xffffffff
+#endif
+
+struct node {
+    struct node * next;
+    fuse_ino_t ino;
+    bson_oid_t oid;
+    int has_oid;
+    uint64_t nlookup;
+    char * path;
+};
+
+struct dirbuf {
+    fuse_req_t req;
+    char * p;
+    size_t size;
+    unsigned long seq;
+};
+
+static struct node * nodes[NODE_BUCKETS];
+static pthread_mutex_t node_lock = PTHREAD_MUTEX_INITIALIZER;
+static double ll_timeout = 1.0;
+
+int mongo_mkdir(const char * path, mode_t mode);
+int mongo_rmdir(const char * path);
+int mongo_read(const char *path, char *buf, size_t size, off_t offset,
+               struct fuse_file_info *fi);
+int mongo_write(const char *path, const char *buf, size_t size,
+               off_t offset, struct fuse_file_info *fi);
+int mongo_rename(const char * path, const char * newpath);
+int mongo_create(const char * path, mode_t mode, struct fuse_file_info * fi);
+int mongo_truncate(const char * path, off_t off);
+int mongo_ftruncate(const char * path, off_t off, struct fuse_file_info * fi);
+int mongo_link(const char * path, const char * newpath);
+int mongo_unlink(const char * path);
+int mongo_chmod(const char * path, mode_t mode);
+int mongo_chown(const char * path, uid_t user, gid_t group);
+int mongo_utimens(const char * path, const struct timespec tv[2]);
+int mongo_access(const char * path, int amode);
+int mongo_symlink(const char * path, const char * target);
+int mongo_readlink(const char * path, char * out, size_t outlen);
+int mongo_flush(const char * path, struct fuse_file_info * fi);
+int mongo_fsync(const char * path, int syncdata, struct fuse_file_info * fi);
+int mongo_release(const char * path, struct fuse_file_info * fi);
+int mongo_fallocate(const char * path, int mode, off_t off, off_t len,
+    struct fuse_file_info * fi);
+#ifdef __APPLE__
+int mongo_getxattr(const char * path, const char * name,
+    char * value, size_t size, uint32_t position);
+#else
+int mongo_getxattr(const char * path, const char * name,
+    char * value, size_t size);
+#endif
+void *mongo_initfs(struct fuse_conn_info * conn);
+void getattr_impl(struct inode * e, struct stat * stbuf);
+
+void setup_lowlevel(double timeout) {
+    ll_timeout = timeout;
+}
+
+static fuse_ino_t oid_ino(const bson_oid_t * oid) {
+    const uint8_t * p = (const uint8_t*)oid;
+    uint64_t h = 14695981039346656037ULL;
+    size_t i;
+
+    for(i = 0; i < sizeof(bson_oid_t); i++) {
+        h ^= p[i];
+        h *= 1099511628211ULL;
+    }
+    if(sizeof(fuse_ino_t) < sizeof(h))
+        h ^= h >> 32;
+    return (fuse_ino_t)h;
+}
+
+/* Must be called with node_lock held. */
+static struct node * find_node(fuse_ino_t ino) {
+    struct node * n = nodes[ino % NODE_BUCKETS];
+    while(n && n->ino != ino)
+        n = n->next;
+    return n;
+}
+
+/*
+ * Finds the node for oid, or the inode number it should get if it isn't
+ * in the table. Colliding hashes probe upwards past numbers that are
+ * taken or reserved. Must be called with node_lock held.
+ */
+static struct node * find_oid(const bson_oid_t * oid, fuse_ino_t * pino) {
+    fuse_ino_t ino = oid_ino(oid);
+    struct node * n;
+
+    for(;; ino++) {
+        if(ino == 0 || ino == FUSE_ROOT_ID || ino == FUSE_UNKNOWN_INO)
+            continue;
+        if((n = find_node(ino)) == NULL)
+            break;
+        if(n->has_oid && memcmp(&n->oid, oid, sizeof(bson_oid_t)) == 0)
+            return n;
+    }
+    *pino = ino;
+    return NULL;
+}
+
+static int set_path(struct node * n, const char * path) {
+    char * copy;
+    if(n->path && strcmp(n->path, path) == 0)
+        return 0;
+    if((copy = strdup(path)) == NULL)
+        return -ENOMEM;
+    free(n->path);
+    n->path = copy;
+    return 0;
+}
+
+static int path_under(const char * path, const char * prefix, size_t len) {
+    return strncmp(path, prefix, len) == 0 &&
+        (path[len] == '\0' || path[len] == '/');
+}
+
+/*
+ * Moves the remembered paths of oldpath and everything under it to
+ * newpath, and forgets the paths of whatever was at newpath before. With
+ * no newpath the paths are only forgotten. A node without a path can
+ * still be used by _id until it's looked up again.
+ */
+static void move_paths(const char * oldpath, const char * newpath) {
+    size_t oldlen = strlen(oldpath), newlen = newpath ? strlen(newpath) : 0;
+    struct node * n;
+    char * moved;
+    int i;
+
+    pthread_mutex_lock(&node_lock);
+    for(i = 0; i < NODE_BUCKETS; i++) {
+        for(n = nodes[i]; n; n = n->next) {
+            if(!n->path || n->ino == FUSE_ROOT_ID)
+                continue;
+            if(newpath && path_under(n->path, oldpath, oldlen)) {
+                moved = malloc(newlen + strlen(n->path + oldlen) + 1);
+                if(moved)
+                    sprintf(moved, "%s%s", newpath, n->path + oldlen);
+            } else if(path_under(n->path, newpath ? newpath : oldpath,
+                newpath ? newlen : oldlen))
+                moved = NULL;
+            else
+                continue;
+            free(n->path);
+            n->path = moved;
+        }
+    }
+    pthread_mutex_unlock(&node_lock);
+}
+
+/*
+ * Records a lookup of the inode oid under path and returns its inode
+ * number, or 0 if we ran out of memory.
+ */
+static fuse_ino_t remember(const bson_oid_t * oid, const char * path) {
+    struct node * n;
+    fuse_ino_t ino = 0;
+
+    pthread_mutex_lock(&node_lock);
+    if(strcmp(path, "/") == 0)
+        n = find_node(FUSE_ROOT_ID);
+    else if((n = find_oid(oid, &ino)) == NULL) {
+        if((n = calloc(1, sizeof(struct node))) == NULL) {
+            pthread_mutex_unlock(&node_lock);
+            return 0;
+        }
+        n->ino = ino;
+        memcpy(&n->oid, oid, sizeof(bson_oid_t));
+        n->has_oid = 1;
+        n->next = nodes[ino % NODE_BUCKETS];
+        nodes[ino % NODE_BUCKETS] = n;
+    }
+    // The kernel will only forget what it was told about, so a failure
+    // here still counts as a lookup.
+    set_path(n, path);
+    n->nlookup++;
+    ino = n->ino;
+    pthread_mutex_unlock(&node_lock);
+    return ino;
+}
+
+static void forget_node(fuse_ino_t ino, unsigned long nlookup) {
+    struct node ** pn, * n;
+
+    pthread_mutex_lock(&node_lock);
+    pn = &nodes[ino % NODE_BUCKETS];
+    while(*pn && (*pn)->ino != ino)
+        pn = &(*pn)->next;
+    if((n = *pn) != NULL && ino != FUSE_ROOT_ID) {
+        n->nlookup -= nlookup < n->nlookup ? nlookup : n->nlookup;
+        if(n->nlookup == 0) {
+            *pn = n->next;
+            free(n->path);
+            free(n);
+        }
+    }
+    pthread_mutex_unlock(&node_lock);
+}
+
+/* Copies out the path ino was last looked up by. */
+static int node_path(fuse_ino_t ino, char * out) {
+    struct node * n;
+    int res = 0;
+
+    pthread_mutex_lock(&node_lock);
+    if((n = find_node(ino)) == NULL || !n->path)
+        res = -ESTALE;
+    else if(strlen(n->path) >= PATH_MAX)
+        res = -ENAMETOOLONG;
+    else
+        strcpy(out, n->path);
+    pthread_mutex_unlock(&node_lock);
+    return res;
+}
+
+static int node_oid(fuse_ino_t ino, bson_oid_t * out) {
+    struct node * n;
+    int res = 0;
+
+    pthread_mutex_lock(&node_lock);
+    if((n = find_node(ino)) == NULL || !n->has_oid)
+        res = -ESTALE;
+    else
+        memcpy(out, &n->oid, sizeof(bson_oid_t));
+    pthread_mutex_unlock(&node_lock);
+    return res;
+}
+
+static int child_path(fuse_ino_t parent, const char * name, char * out) {
+    size_t len;
+    int res;
+
+    if((res = node_path(parent, out)) != 0)
+        return res;
+    len = strlen(out);
+    if(len + strlen(name) + 2 > PATH_MAX)
+        return -ENAMETOOLONG;
+    sprintf(out + len, "%s%s", len > 1 ? "/" : "", name);
+    return 0;
+}
+
+static int ll_enter(fuse_req_t req) {
+    const struct fuse_ctx * ctx = fuse_req_ctx(req);
+    int res;
+
+    if((res = set_caller(ctx->uid, ctx->gid)) != 0)
+        return res;
+    if((res = pool_enter()) != 0)
+        clear_caller();
+    return res;
+}
+
+static void ll_leave() {
+    pool_leave();
+    clear_caller();
+}
+
+static int fill_entry(struct fuse_entry_param * ep, struct inode * e,
+    const char * path) {
+    memset(ep, 0, sizeof(struct fuse_entry_param));
+    getattr_impl(e, &ep->attr);
+    if((ep->ino = remember(&e->oid, path)) == 0)
+        return -ENOMEM;
+    ep->attr.st_ino = ep->ino;
+    ep->attr_timeout = ll_timeout;
+    ep->entry_timeout = ll_timeout;
+    return 0;
+}
+
+/* Replies to a request that created path with its new entry. */
+static void reply_new_entry(fuse_req_t req, const char * path) {
+    struct fuse_entry_param ep;
+    struct inode e;
+    int res;
+
+    if((res = get_inode_attrs(path, &e)) == 0)
+        res = fill_entry(&ep, &e, path);
+    free_inode(&e);
+    if(res != 0)
+        fuse_reply_err(req, -res);
+    else
+        fuse_reply_entry(req, &ep);
+}
+
+static void reply_attr(fuse_req_t req, fuse_ino_t ino) {
+    struct inode e;
+    struct stat st;
+    bson_oid_t oid;
+    int res;
+
+    if(ino == FUSE_ROOT_ID)
+        res = get_inode_attrs("/", &e);
+    else if((res = node_oid(ino, &oid)) == 0)
+        res = get_inode_by_oid(&oid, &e, FIELDS_ATTRS);
+    else
+        init_inode(&e);
+    if(res == 0) {
+        getattr_impl(&e, &st);
+        st.st_ino = ino;
+    }
+    free_inode(&e);
+    if(res != 0)
+        fuse_reply_err(req, -res);
+    else
+        fuse_reply_attr(req, &st, ll_timeout);
+}
+
+static void ll_init(void * userdata, struct fuse_conn_info * conn) {
+    struct node * root;
+
+    mongo_initfs(conn);
+    if((root = calloc(1, sizeof(struct node))) == NULL ||
+        (root->path = strdup("/")) == NULL) {
+        fprintf(stderr, "Error allocating root node\n");
+        free(root);
+        return;
+    }
+    root->ino = FUSE_ROOT_ID;
+    root->nlookup = 1;
+    nodes[FUSE_ROOT_ID % NODE_BUCKETS] = root;
+}
+
+static void ll_lookup(fuse_req_t req, fuse_ino_t parent, const char * name) {
+    struct fuse_entry_param ep;
+    struct inode e;
+    char path[PATH_MAX];
+    int res;
+
+    if((res = child_path(parent, name, path)) != 0 ||
+        (res = ll_enter(req)) != 0) {
+        fuse_reply_err(req, -res);
+        return;
+    }
+    res = get_inode_attrs(path, &e);
+    if(res == 0)
+        res = fill_entry(&ep, &e, path);
+    else if(res == -ENOENT) {
+        // Lets the kernel cache the miss too.
+        memset(&ep, 0, sizeof(ep));
+        ep.entry_timeout = ll_timeout;
+        res = 0;
+    }
+    free_inode(&e);
+    ll_leave();
+    if(res != 0)
+        fuse_reply_err(req, -res);
+    else
+        fuse_reply_entry(req, &ep);
+}
+
+static void ll_forget(fuse_req_t req, fuse_ino_t ino, unsigned long nlookup) {
+    forget_node(ino, nlookup);
+    fuse_reply_none(req);
+}
+
+static void ll_getattr(fuse_req_t req, fuse_ino_t ino,
+    struct fuse_file_info * fi) {
+    int res;
+
+    if((res = ll_enter(req)) != 0) {
+        fuse_reply_err(req, -res);
+        return;
+    }
+    reply_attr(req, ino);
+    ll_leave();
+}
+
+/*
+ * Applies attribute changes to the inode itself rather than by path, so
+ * they still work once every name it was looked up by is gone. Changes go
+ * to the open inode when truncating through a handle, so its commit
+ * doesn't put back the old attributes.
+ */
+static void ll_setattr(fuse_req_t req, fuse_ino_t ino, struct stat * attr,
+    int to_set, struct fuse_file_info * fi) {
+    char path[PATH_MAX], * name;
+    struct timespec tv[2];
+    struct inode le, * e = &le;
+    bson_oid_t oid;
+    int touched = 0, res;
+
+    if(ino != FUSE_ROOT_ID && (res = node_oid(ino, &oid)) != 0) {
+        fuse_reply_err(req, -res);
+        return;
+    }
+    if((res = ll_enter(req)) != 0) {
+        fuse_reply_err(req, -res);
+        return;
+    }
+
+    if(fi && (to_set & FUSE_SET_ATTR_SIZE))
+        e = (struct inode*)fi->fh;
+    else if(ino == FUSE_ROOT_ID)
+        res = get_inode("/", e);
+    else
+        res = get_inode_by_oid(&oid, e, FIELDS_ALL);
+
+    if(res == 0) {
+        if(to_set & FUSE_SET_ATTR_MODE)
+            e->mode = (e->mode & S_IFMT) | (attr->st_mode & ~S_IFMT);
+        if(to_set & FUSE_SET_ATTR_UID)
+            e->owner = attr->st_uid;
+        if(to_set & FUSE_SET_ATTR_GID)
+            e->group = attr->st_gid;
+        // Only the modification time is stored.
+#ifdef FUSE_SET_ATTR_MTIME_NOW
+        if(to_set & FUSE_SET_ATTR_MTIME_NOW) {
+            e->modified = time(NULL);
+            touched = 1;
+        } else
+#endif
+        if(to_set & FUSE_SET_ATTR_MTIME) {
+            e->modified = attr->st_mtime;
+            touched = 1;
+        }
+        if((to_set & FUSE_SET_ATTR_SIZE) && attr->st_size != e->size)
+            res = do_trunc(e, attr->st_size);
+        if(res == 0)
+            res = commit_inode(e);
+    }
+
+    // Touching a .snapshot directory takes a snapshot, which needs the
+    // path it's under.
+    if(res == 0 && touched && (e->mode & S_IFDIR) &&
+        node_path(ino, path) == 0 && (name = strrchr(path, '/')) != NULL &&
+        strcmp(name + 1, ".snapshot") == 0) {
+        memset(tv, 0, sizeof(tv));
+        tv[1].tv_sec = e->modified;
+        res = mongo_utimens(path, tv);
+    }
+    if(e == &le)
+        free_inode(e);
+
+    if(res != 0)
+        fuse_reply_err(req, -res);
+    else
+        reply_attr(req, ino);
+    ll_leave();
+}
+
+static void ll_readlink(fuse_req_t req, fuse_ino_t ino) {
+    char path[PATH_MAX], target[PATH_MAX + 1];
+    int res;
+
+    if((res = node_path(ino, path)) != 0 || (res = ll_enter(req)) != 0) {
+        fuse_reply_err(req, -res);
+        return;
+    }
+    memset(target, 0, sizeof(target));
+    res = mongo_readlink(path, target, PATH_MAX);
+    ll_leave();
+    if(res != 0)
+        fuse_reply_err(req, -res);
+    else
+        fuse_reply_readlink(req, target);
+}
+
+static void ll_mkdir(fuse_req_t req, fuse_ino_t parent, const char * name,
+    mode_t mode) {
+    char path[PATH_MAX];
+    int res;
+
+    if((res = child_path(parent, name, path)) != 0 ||
+        (res = ll_enter(req)) != 0) {
+        fuse_reply_err(req, -res);
+        return;
+    }
+    if((res = mongo_mkdir(path, mode)) != 0)
+        fuse_reply_err(req, -res);
+    else
+        reply_new_entry(req, path);
+    ll_leave();
+}
+
+static void ll_symlink(fuse_req_t req, const char * link, fuse_ino_t parent,
+    const char * name) {
+    char path[PATH_MAX];
+    int res;
+
+    if((res = child_path(parent, name, path)) != 0 ||
+        (res = ll_enter(req)) != 0) {
+        fuse_reply_err(req, -res);
+        return;
+    }
+    if((res = mongo_symlink(link, path)) != 0)
+        fuse_reply_err(req, -res);
+    else
+        reply_new_entry(req, path);
+    ll_leave();
+}
+
+static void ll_unlink(fuse_req_t req, fuse_ino_t parent, const char * name) {
+    char path[PATH_MAX];
+    int res;
+
+    if((res = child_path(parent, name, path)) == 0 &&
+        (res = ll_enter(req)) == 0) {
+        if((res = mongo_unlink(path)) == 0)
+            move_paths(path, NULL);
+        ll_leave();
+    }
+    fuse_reply_err(req, -res);
+}
+
+static void ll_rmdir(fuse_req_t req, fuse_ino_t parent, const char * name) {
+    char path[PATH_MAX];
+    int res;
+
+    if((res = child_path(parent, name, path)) == 0 &&
+        (res = ll_enter(req)) == 0) {
+        if((res = mongo_rmdir(path)) == 0)
+            move_paths(path, NULL);
+        ll_leave();
+    }
+    fuse_reply_err(req, -res);
+}
+
+static void ll_rename(fuse_req_t req, fuse_ino_t parent, const char * name,
+    fuse_ino_t newparent, const char * newname) {
+    char path[PATH_MAX], newpath[PATH_MAX];
+    int res;
+
+    if((res = child_path(parent, name, path)) != 0 ||
+        (res = child_path(newparent, newname, newpath)) != 0 ||
+        (res = ll_enter(req)) != 0) {
+        fuse_reply_err(req, -res);
+        return;
+    }
+    // Keep the paths current for nodes the kernel still holds.
+    if((res = mongo_rename(path, newpath)) == 0 && strcmp(path, newpath) != 0)
+        move_paths(path, newpath);
+    ll_leave();
+    fuse_reply_err(req, -res);
+}
+
+static void ll_link(fuse_req_t req, fuse_ino_t ino, fuse_ino_t newparent,
+    const char * newname) {
+    char path[PATH_MAX], newpath[PATH_MAX];
+    int res;
+
+    if((res = node_path(ino, path)) != 0 ||
+        (res = child_path(newparent, newname, newpath)) != 0 ||
+        (res = ll_enter(req)) != 0) {
+        fuse_reply_err(req, -res);
+        return;
+    }
+    if((res = mongo_link(path, newpath)) != 0)
+        fuse_reply_err(req, -res);
+    else
+        reply_new_entry(req, newpath);
+    ll_leave();
+}
+
+static void ll_open(fuse_req_t req, fuse_ino_t ino,
+    struct fuse_file_info * fi) {
+    struct inode * e;
+    bson_oid_t oid;
+    int res;
+
+    if((res = node_oid(ino, &oid)) != 0 || (res = ll_enter(req)) != 0) {
+        fuse_reply_err(req, -res);
+        return;
+    }
+    if((e = malloc(sizeof(struct inode))) == NULL)
+        res = -ENOMEM;
+    else if((res = get_inode_by_oid(&oid, e, FIELDS_ALL)) != 0) {
+        free_inode(e);
+        free(e);
+    }
+    ll_leave();
+    if(res != 0) {
+        fuse_reply_err(req, -res);
+        return;
+    }
+    e->updated = time(NULL);
+    e->wr_age = e->updated;
+    e->db_size = e->size;
+    fi->fh = (uintptr_t)e;
+    fuse_reply_open(req, fi);
+}
+
+static void ll_read(fuse_req_t req, fuse_ino_t ino, size_t size, off_t off,
+    struct fuse_file_info * fi) {
+    char path[PATH_MAX], * buf;
+    int res;
+
+    if((res = node_path(ino, path)) != 0 || (res = ll_enter(req)) != 0) {
+        fuse_reply_err(req, -res);
+        return;
+    }
+    if((buf = malloc(size)) == NULL)
+        res = -ENOMEM;
+    else
+        res = mongo_read(path, buf, size, off, fi);
+    ll_leave();
+    if(res < 0)
+        fuse_reply_err(req, -res);
+    else
+        fuse_reply_buf(req, buf, res);
+    free(buf);
+}
+
+static void ll_write(fuse_req_t req, fuse_ino_t ino, const char * buf,
+    size_t size, off_t off, struct fuse_file_info * fi) {
+    char path[PATH_MAX];
+    int res;
+
+    if((res = node_path(ino, path)) != 0 || (res = ll_enter(req)) != 0) {
+        fuse_reply_err(req, -res);
+        return;
+    }
+    res = mongo_write(path, buf, size, off, fi);
+    ll_leave();
+    if(res < 0)
+        fuse_reply_err(req, -res);
+    else
+        fuse_reply_write(req, res);
+}
+
+static void ll_flush(fuse_req_t req, fuse_ino_t ino,
+    struct fuse_file_info * fi) {
+    int res;
+
+    if((res = ll_enter(req)) == 0) {
+        res = mongo_flush(NULL, fi);
+        ll_leave();
+    }
+    fuse_reply_err(req, -res);
+}
+
+static void ll_fsync(fuse_req_t req, fuse_ino_t ino, int datasync,
+    struct fuse_file_info * fi) {
+    int res;
+
+    if((res = ll_enter(req)) == 0) {
+        res = mongo_fsync(NULL, datasync, fi);
+        ll_leave();
+    }
+    fuse_reply_err(req, -res);
+}
+
+static void ll_release(fuse_req_t req, fuse_ino_t ino,
+    struct fuse_file_info * fi) {
+    int res;
+
+    if((res = ll_enter(req)) == 0) {
+        res = mongo_release(NULL, fi);
+        ll_leave();
+    }
+    fuse_reply_err(req, -res);
+}
+
+#if FUSE_VERSION >= 29
+static void ll_fallocate(fuse_req_t req, fuse_ino_t ino, int mode,
+    off_t off, off_t len, struct fuse_file_info * fi) {
+    char path[PATH_MAX];
+    int res;
+
+    if((res = node_path(ino, path)) == 0 && (res = ll_enter(req)) == 0) {
+        res = mongo_fallocate(path, mode, off, len, fi);
+        ll_leave();
+    }
+    fuse_reply_err(req, -res);
+}
+#endif
+
+static int add_dirent(struct dirbuf * db, const char * name, mode_t mode,
+    fuse_ino_t ino) {
+    struct stat st;
+    size_t oldsize = db->size;
+    char * p;
+
+    memset(&st, 0, sizeof(st));
+    st.st_mode = mode;
+    st.st_ino = ino;
+
+    db->size += fuse_add_direntry(db->req, NULL, 0, name, NULL, 0);
+    if((p = realloc(db->p, db->size)) == NULL) {
+        db->size = oldsize;
+        return -ENOMEM;
+    }
+    db->p = p;
+    fuse_add_direntry(db->req, db->p + oldsize, db->size - oldsize,
+        name, &st, db->size);
+    return 0;
+}
+
+/*
+ * The inode number oid has, or will get when it's looked up if nothing
+ * else takes it first.
+ */
+static fuse_ino_t oid_node_ino(const bson_oid_t * oid) {
+    struct node * n;
+    fuse_ino_t ino;
+
+    pthread_mutex_lock(&node_lock);
+    if((n = find_oid(oid, &ino)) != NULL)
+        ino = n->ino;
+    pthread_mutex_unlock(&node_lock);
+    return ino;
+}
+
+/* Like readdir_cb, but with the inode number of each entry. */
+static int dirbuf_cb(struct inode * e, void * p,
+    const char * parent, size_t parentlen) {
+    struct dirbuf * db = p;
+    size_t printlen = parentlen > 1 ? parentlen + 1 : parentlen;
+    struct dirent * cde;
+    fuse_ino_t ino = oid_node_ino(&e->oid);
+    int res;
+
+    for(cde = e->dirents; cde; cde = cde->next) {
+        if(parent_len(cde->path, cde->len) != parentlen ||
+            strncmp(cde->path, parent, parentlen) != 0 ||
+            strcmp(cde->path + printlen, ".snapshot") == 0)
+            continue;
+        meta_cache_put(cde->path, e, db->seq);
+        if((res = add_dirent(db, cde->path + printlen, e->mode, ino)) != 0)
+            return res;
+    }
+    return 0;
+}
+
+/*
+ * Directories are listed in full when they're opened, and readdir hands
+ * out pieces of that listing by offset.
+ */
+static void ll_opendir(fuse_req_t req, fuse_ino_t ino,
+    struct fuse_file_info * fi) {
+    char path[PATH_MAX];
+    struct dirbuf * db;
+    int res;
+
+    if((res = node_path(ino, path)) != 0 || (res = ll_enter(req)) != 0) {
+        fuse_reply_err(req, -res);
+        return;
+    }
+    if((db = calloc(1, sizeof(struct dirbuf))) == NULL)
+        res = -ENOMEM;
+    else {
+        db->req = req;
+        db->seq = meta_cache_seq();
+        // Only the kernel knows which directory ".." was reached through.
+        if((res = add_dirent(db, ".", S_IFDIR, ino)) != 0 ||
+            (res = add_dirent(db, "..", S_IFDIR, FUSE_UNKNOWN_INO)) != 0 ||
+            (res = read_dirents(path, dirbuf_cb, db, FIELDS_LISTING)) != 0) {
+            free(db->p);
+            free(db);
+        }
+    }
+    ll_leave();
+    if(res != 0) {
+        fuse_reply_err(req, -res);
+        return;
+    }
+    fi->fh = (uintptr_t)db;
+    fuse_reply_open(req, fi);
+}
+
+static void ll_readdir(fuse_req_t req, fuse_ino_t ino, size_t size,
+    off_t off, struct fuse_file_info * fi) {
+    struct dirbuf * db = (struct dirbuf*)fi->fh;
+
+    if(off >= db->size)
+        fuse_reply_buf(req, NULL, 0);
+    else
+        fuse_reply_buf(req, db->p + off,
+            db->size - off < size ? db->size - off : size);
+}
+
+static void ll_releasedir(fuse_req_t req, fuse_ino_t ino,
+    struct fuse_file_info * fi) {
+    struct dirbuf * db = (struct dirbuf*)fi->fh;
+    free(db->p);
+    free(db);
+    fuse_reply_err(req, 0);
+}
+
+static void ll_access(fuse_req_t req, fuse_ino_t ino, int mask) {
+    char path[PATH_MAX];
+    int res;
+
+    if((res = node_path(ino, path)) == 0 && (res = ll_enter(req)) == 0) {
+        res = mongo_access(path, mask);
+        ll_leave();
+    }
+    fuse_reply_err(req, -res);
+}
+
+static void ll_create(fuse_req_t req, fuse_ino_t parent, const char * name,
+    mode_t mode, struct fuse_file_info * fi) {
+    struct fuse_entry_param ep;
+    char path[PATH_MAX];
+    int res;
+
+    if((res = child_path(parent, name, path)) != 0 ||
+        (res = ll_enter(req)) != 0) {
+        fuse_reply_err(req, -res);
+        return;
+    }
+    if((res = mongo_create(path, mode, fi)) == 0 &&
+        (res = fill_entry(&ep, (struct inode*)fi->fh, path)) != 0)
+        mongo_release(path, fi);
+    ll_leave();
+    if(res != 0)
+        fuse_reply_err(req, -res);
+    else
+        fuse_reply_create(req, &ep, fi);
+}
+
+#ifdef __APPLE__
+static void ll_getxattr(fuse_req_t req, fuse_ino_t ino, const char * name,
+    size_t size, uint32_t position) {
+#else
+static void ll_getxattr(fuse_req_t req, fuse_ino_t ino, const char * name,
+    size_t size) {
+#endif
+    char value[256];
+    int res;
+
+#ifdef __APPLE__
+    res = mongo_getxattr(NULL, name, value, size < sizeof(value) ?
+        size : sizeof(value), position);
+#else
+    res = mongo_getxattr(NULL, name, value, size < sizeof(value) ?
+        size : sizeof(value));
+#endif
+    if(res < 0)
+        fuse_reply_err(req, -res);
+    else if(size == 0)
+        fuse_reply_xattr(req, res);
+    else
+        fuse_reply_buf(req, value, res);
+}
+
+static struct fuse_lowlevel_ops mongo_ll_oper = {
+    .init       = ll_init,
+    .lookup     = ll_lookup,
+    .forget     = ll_forget,
+    .getattr    = ll_getattr,
+    .setattr    = ll_setattr,
+    .readlink   = ll_readlink,
+    .mkdir      = ll_mkdir,
+    .unlink     = ll_unlink,
+    .rmdir      = ll_rmdir,
+    .symlink    = ll_symlink,
+    .rename     = ll_rename,
+    .link       = ll_link,
+    .open       = ll_open,
+    .read       = ll_read,
+    .write      = ll_write,
+    .flush      = ll_flush,
+    .release    = ll_release,
+    .fsync      = ll_fsync,
+    .opendir    = ll_opendir,
+    .readdir    = ll_readdir,
+    .releasedir = ll_releasedir,
+    .getxattr   = ll_getxattr,
+    .access     = ll_access,
+    .create     = ll_create,
+#if FUSE_VERSION >= 29
+    .fallocate  = ll_fallocate,
+#endif
+};
+
+int lowlevel_main(struct fuse_args * args) {
+    struct fuse_chan * ch;
+    struct fuse_session * se;
+    char * mountpoint;
+    int multithreaded, foreground, err = -1;
+
+    if(fuse_parse_cmdline(args, &mountpoint, &multithreaded,
+        &foreground) == -1)
+        return 1;
+
+    if((ch = fuse_mount(mountpoint, args)) != NULL) {
+        se = fuse_lowlevel_new(args, &mongo_ll_oper,
+            sizeof(mongo_ll_oper), NULL);
+        if(se) {
+            if(fuse_set_signal_handlers(se) != -1) {
+                fuse_session_add_chan(se, ch);
+#if FUSE_VERSION >= 27
+                fuse_daemonize(foreground);
+#endif
+                if(multithreaded)
+                    err = fuse_session_loop_mt(se);
+                else
+                    err = fuse_session_loop(se);
+                fuse_remove_signal_handlers(se);
+                fuse_session_remove_chan(ch);
+            }
+            fuse_session_destroy(se);
+        }
+        fuse_unmount(mountpoint, ch);
+    }
+    free(mountpoint);
+    fuse_opt_free_args(args);
+    return err ? 1 : 0;
+}
@@ -0,0 +1,304 @@
+#include <pthread.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <time.h>
+#include <mongo.h>
+#include "mongo-fuse.h"
+
+/*
+ * Process-wide cache of inode attributes by path, so getattr, access and
+ * readlink don't each cost a round trip to the inodes collection. Entries
+ * hold everything those need except the dirents themselves. Paths that
+ * don't exist are cached too, and directory listings fill in entries for
+ * everything they return. Entries expire after a configurable TTL, which
+ * bounds how stale they can get from changes made by other mounts; local
+ * changes invalidate the paths they touch. Anything that's going to
+ * modify and commit an inode still reads it with get_inode.
+ */
+
+#define META_CACHE_SHARDS 16
+#define META_CACHE_ENTRIES 65536
+
+struct meta_entry {
+    struct meta_entry * hnext;
+    struct meta_entry * lru_prev;
+    struct meta_entry * lru_next;
+    uint64_t expires;
+    uint32_t hash;
+    int negative;
+    bson_oid_t oid;
+    int direntcount;
+    uint32_t mode;
+    uint64_t owner;
+    uint64_t group;
+    uint64_t size;
+    time_t created;
+    time_t modified;
+    char * data;
+    size_t datalen;
+    char path[1];
+};
+
+struct meta_shard {
+    pthread_mutex_t lock;
+    struct meta_entry * buckets[1024];
+    struct meta_entry * lru_head;
+    struct meta_entry * lru_tail;
+    size_t count;
+    // meta_seq as of the shard's last invalidation.
+    unsigned long seq;
+};
+
+static struct meta_shard shards[META_CACHE_SHARDS];
+static uint64_t meta_ttl = 0;
+// Bumped by every invalidation, and recorded in the shard it touched, so
+// a lookup that raced with one in its own shard doesn't put back what it
+// read from before the change. Invalidations elsewhere don't matter.
+static unsigned long meta_seq = 0;
+
+static uint64_t now_ms() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+static uint32_t path_hash(const char * path) {
+    uint32_t h = 2166136261u;
+    while(*path) {
+        h ^= (uint8_t)*path++;
+        h *= 16777619u;
+    }
+    return h;
+}
+
+void setup_meta_cache(int ttl_ms) {
+    int i;
+
+    if(ttl_ms <= 0)
+        return;
+    for(i = 0; i < META_CACHE_SHARDS; i++)
+        pthread_mutex_init(&shards[i].lock, NULL);
+    meta_ttl = ttl_ms;
+}
+
+static struct meta_entry ** find_slot(struct meta_shard * s,
+    const char * path, uint32_t hash) {
+    struct meta_entry ** slot = &s->buckets[(hash >> 4) % 1024];
+    while(*slot && ((*slot)->hash != hash ||
+        strcmp((*slot)->path, path) != 0))
+        slot = &(*slot)->hnext;
+    return slot;
+}
+
+static void lru_unlink(struct meta_shard * s, struct meta_entry * m) {
+    if(m->lru_prev)
+        m->lru_prev->lru_next = m->lru_next;
+    else
+        s->lru_head = m->lru_next;
+    if(m->lru_next)
+        m->lru_next->lru_prev = m->lru_prev;
+    else
+        s->lru_tail = m->lru_prev;
+}
+
+static void lru_push(struct meta_shard * s, struct meta_entry * m) {
+    m->lru_prev = NULL;
+    m->lru_next = s->lru_head;
+    if(s->lru_head)
+        s->lru_head->lru_prev = m;
+    s->lru_head = m;
+    if(!s->lru_tail)
+        s->lru_tail = m;
+}
+
+/* Must be called with the shard locked. */
+static void remove_entry(struct meta_shard * s, struct meta_entry ** slot) {
+    struct meta_entry * m = *slot;
+    *slot = m->hnext;
+    lru_unlink(s, m);
+    s->count--;
+    if(m->data)
+        free(m->data);
+    free(m);
+}
+
+/*
+ * Returns 0 and fills in out if path is cached, -ENOENT if it's cached as
+ * not existing, or 1 if it isn't cached.
+ */
+static int meta_cache_get(const char * path, struct inode * out) {
+    uint32_t hash = path_hash(path);
+    struct meta_shard * s = &shards[hash % META_CACHE_SHARDS];
+    struct meta_entry ** slot, * m;
+    int res;
+
+    pthread_mutex_lock(&s->lock);
+    slot = find_slot(s, path, hash);
+    if(!(m = *slot)) {
+        pthread_mutex_unlock(&s->lock);
+        return 1;
+    }
+    if(m->expires <= now_ms()) {
+        remove_entry(s, slot);
+        pthread_mutex_unlock(&s->lock);
+        return 1;
+    }
+
+    if(m->negative)
+        res = -ENOENT;
+    else {
+        memcpy(&out->oid, &m->oid, sizeof(bson_oid_t));
+        out->direntcount = m->direntcount;
+        out->mode = m->mode;
+        out->owner = m->owner;
+        out->group = m->group;
+        out->size = m->size;
+        out->created = m->created;
+        out->modified = m->modified;
+        if(m->data && (out->data = malloc(m->datalen + 1)) != NULL) {
+            memcpy(out->data, m->data, m->datalen + 1);
+            out->datalen = m->datalen;
+        }
+        res = 0;
+    }
+    pthread_mutex_unlock(&s->lock);
+    return res;
+}
+
+/*
+ * Caches e's attributes under path, or path as not existing if e is NULL.
+ * seq is meta_cache_seq() from before e was read, so the entry is dropped
+ * if its shard was invalidated in the meantime.
+ */
+void meta_cache_put(const char * path, const struct inode * e,
+    unsigned long seq) {
+    uint32_t hash = path_hash(path);
+    struct meta_shard * s = &shards[hash % META_CACHE_SHARDS];
+    struct meta_entry ** slot, * m;
+    size_t pathlen = strlen(path);
+
+    if(meta_ttl == 0)
+        return;
+    if((m = malloc(sizeof(struct meta_entry) + pathlen)) == NULL)
+        return;
+    memset(m, 0, sizeof(struct meta_entry));
+    strcpy(m->path, path);
+    m->hash = hash;
+    m->expires = now_ms() + meta_ttl;
+    if(!e)
+        m->negative = 1;
+    else {
+        memcpy(&m->oid, &e->oid, sizeof(bson_oid_t));
+        m->direntcount = e->direntcount;
+        m->mode = e->mode;
+        m->owner = e->owner;
+        m->group = e->group;
+        m->size = e->size;
+        m->created = e->created;
+        m->modified = e->modified;
+        if(e->data && (m->data = malloc(e->datalen + 1)) != NULL) {
+            memcpy(m->data, e->data, e->datalen);
+            m->data[e->datalen] = '\0';
+            m->datalen = e->datalen;
+        }
+    }
+
+    pthread_mutex_lock(&s->lock);
+    if(s->seq > seq) {
+        pthread_mutex_unlock(&s->lock);
+        if(m->data)
+            free(m->data);
+        free(m);
+        return;
+    }
+    slot = find_slot(s, path, hash);
+    if(*slot)
+        remove_entry(s, slot);
+    if(s->count >= META_CACHE_ENTRIES / META_CACHE_SHARDS)
+        remove_entry(s, find_slot(s, s->lru_tail->path, s->lru_tail->hash));
+    slot = find_slot(s, path, hash);
+    m->hnext = NULL;
+    *slot = m;
+    lru_push(s, m);
+    s->count++;
+    pthread_mutex_unlock(&s->lock);
+}
+
+unsigned long meta_cache_seq() {
+    return __sync_fetch_and_add(&meta_seq, 0);
+}
+
+void meta_cache_invalidate(const char * path) {
+    uint32_t hash = path_hash(path);
+    struct meta_shard * s = &shards[hash % META_CACHE_SHARDS];
+    struct meta_entry ** slot;
+
+    if(meta_ttl == 0)
+        return;
+
+    pthread_mutex_lock(&s->lock);
+    s->seq = __sync_add_and_fetch(&meta_seq, 1);
+    slot = find_slot(s, path, hash);
+    if(*slot)
+        remove_entry(s, slot);
+    pthread_mutex_unlock(&s->lock);
+}
+
+void meta_cache_invalidate_inode(const struct inode * e) {
+    struct dirent * d;
+    for(d = e->dirents; d; d = d->next)
+        meta_cache_invalidate(d->path);
+}
+
+/* Drops path and everything under it. */
+void meta_cache_invalidate_tree(const char * path) {
+    size_t pathlen = strlen(path);
+    struct meta_entry ** slot;
+    int i, j;
+
+    if(meta_ttl == 0)
+        return;
+
+    for(i = 0; i < META_CACHE_SHARDS; i++) {
+        struct meta_shard * s = &shards[i];
+        pthread_mutex_lock(&s->lock);
+        s->seq = __sync_add_and_fetch(&meta_seq, 1);
+        for(j = 0; j < 1024; j++) {
+            slot = &s->buckets[j];
+            while(*slot) {
+                const char * p = (*slot)->path;
+                if(strncmp(p, path, pathlen) == 0 &&
+                    (p[pathlen] == '\0' || p[pathlen] == '/'))
+                    remove_entry(s, slot);
+                else
+                    slot = &(*slot)->hnext;
+            }
+        }
+        pthread_mutex_unlock(&s->lock);
+    }
+}
+
+/*
+ * Like get_inode, but may answer from the cache and doesn't fill in the
+ * inode's dirents, so the result must not be committed.
+ */
+int get_inode_attrs(const char * path, struct inode * out) {
+    unsigned long seq;
+    int res;
+
+    init_inode(out);
+    if(meta_ttl == 0)
+        return get_inode_impl(path, out, FIELDS_ATTRS);
+
+    if((res = meta_cache_get(path, out)) != 1)
+        return res;
+
+    seq = meta_cache_seq();
+    res = get_inode_impl(path, out, FIELDS_ATTRS);
+    if(res == 0)
+        meta_cache_put(path, out, seq);
+    else if(res == -ENOENT)
+        meta_cache_put(path, NULL, seq);
+    return res;
+}
@@ -25,11 +25,19 @@
 char * blocks_name;
 char * inodes_name;
 char * extents_name;
+char * config_name;
 char * dbname;
 char * inodes_coll = "inodes";
 char * dbname = "test";
 mongo_host_port dbhost;
 mongo_write_concern write_concern;
+static size_t readahead_window = 0;
+static int write_behind_depth = 0;
+static int write_behind_batch = 0;
+static int dedup_seed = 0;
+static int migrate_only = 0;
+static int lowlevel_mode = 0;
+size_t max_block_size = 65536;
 
 int mongo_readdir(const char *path, void *buf, fuse_fill_dir_t filler,
     off_t offset, struct fuse_file_info *fi);
@@ -41,9 +49,11 @@ int mongo_write(const char *path, const char *buf, size_t size,
                off_t offset, struct fuse_file_info *fi);
 int mongo_rename(const char * path, const char * newpath);
 
-static void getattr_impl(struct inode * e, struct stat * stbuf) {
+void getattr_impl(struct inode * e, struct stat * stbuf) {
     memset(stbuf, 0, sizeof(struct stat));
-    stbuf->st_nlink = e->direntcount;
+    // Inodes written before nlink was stored don't have a count unless
+    // their dirents were read.
+    stbuf->st_nlink = e->direntcount > 0 ? e->direntcount : 1;
     stbuf->st_mode = e->mode;
     if(stbuf->st_mode & S_IFDIR)
         stbuf->st_nlink++;
@@ -58,7 +68,7 @@ static int mongo_getattr(const char *path, struct stat *stbuf) {
     int res = 0;
     struct inode e;
 
-    res = get_inode(path, &e);
+    res = get_inode_attrs(path, &e);
     if(res != 0)
         return res;
 
@@ -88,11 +98,12 @@ static int mongo_open(const char *path, struct fuse_file_info *fi)
     fi->fh = (uintptr_t)e;
     e->updated = time(NULL);
     e->wr_age = e->updated;
+    e->db_size = e->size;
 
     return 0;
 }
 
-static int mongo_create(const char * path, mode_t mode, struct fuse_file_info * fi) {
+int mongo_create(const char * path, mode_t mode, struct fuse_file_info * fi) {
     int res = create_inode(path, mode, NULL);
     if(res == -EEXIST && fi->flags & O_EXCL)
         return -EEXIST;
@@ -101,15 +112,15 @@ static int mongo_create(const char * path, mode_t mode, struct fuse_file_info *
     return mongo_open(path, fi);
 }
 
-static int mongo_symlink(const char * path, const char * target) {
+int mongo_symlink(const char * path, const char * target) {
     return create_inode(target, 0120777, path);
 }
 
-static int mongo_readlink(const char * path, char * out, size_t outlen) {
+int mongo_readlink(const char * path, char * out, size_t outlen) {
     struct inode e;
     int res;
 
-    res = get_inode(path, &e);
+    res = get_inode_attrs(path, &e);
     if(res != 0) {
         free_inode(&e);
         return res;
@@ -126,7 +137,7 @@ static int mongo_readlink(const char * path, char * out, size_t outlen) {
     return 0;
 }
 
-static int mongo_truncate(const char * path, off_t off) {
+int mongo_truncate(const char * path, off_t off) {
     struct inode e;
     int res;
 
@@ -148,7 +159,10 @@ static int mongo_truncate(const char * path, off_t off) {
     return 0;
 }
 
-static int mongo_ftruncate(const char * path, off_t off,
+int mongo_fallocate(const char * path, int mode, off_t off, off_t len,
+    struct fuse_file_info * fi);
+
+int mongo_ftruncate(const char * path, off_t off,
     struct fuse_file_info * fi) {
     struct inode * e = (struct inode*)fi->fh;
     int res;
@@ -162,7 +176,7 @@ static int mongo_ftruncate(const char * path, off_t off,
     return commit_inode(e);
 }
 
-static int mongo_link(const char * path, const char * newpath) {
+int mongo_link(const char * path, const char * newpath) {
     struct inode e;
     int res;
     size_t newpathlen = strlen(newpath);
@@ -186,7 +200,7 @@ static int mongo_link(const char * path, const char * newpath) {
     return res;
 }
 
-static int mongo_unlink(const char * path) {
+int mongo_unlink(const char * path) {
     struct inode e;
     int res;
     mongo * conn = get_conn();
@@ -208,6 +222,7 @@ static int mongo_unlink(const char * path) {
         free(c);
         e.direntcount--;
         res = commit_inode(&e);
+        meta_cache_invalidate(path);
         free_inode(&e);
         return res;
     }
@@ -220,13 +235,14 @@ static int mongo_unlink(const char * path) {
 
         res = mongo_remove(conn, inodes_name, &cond, NULL);
         bson_destroy(&cond);
+        meta_cache_invalidate(path);
     }
 
     free_inode(&e);
     return res;
 }
 
-static int mongo_chmod(const char * path, mode_t mode) {
+int mongo_chmod(const char * path, mode_t mode) {
     struct inode e;
     int res;
 
@@ -240,7 +256,7 @@ static int mongo_chmod(const char * path, mode_t mode) {
     return res;
 }
 
-static int mongo_chown(const char * path, uid_t user, gid_t group) {
+int mongo_chown(const char * path, uid_t user, gid_t group) {
     struct inode e;
     int res;
 
@@ -256,7 +272,7 @@ static int mongo_chown(const char * path, uid_t user, gid_t group) {
 
 }
 
-static int mongo_utimens(const char * path, const struct timespec tv[2]) {
+int mongo_utimens(const char * path, const struct timespec tv[2]) {
     struct inode e;
     int res;
 
@@ -286,15 +302,17 @@ static int mongo_utimens(const char * path, const struct timespec tv[2]) {
     return res;
 }
 
-static int mongo_access(const char * path, int amode) {
-    const struct fuse_context * fcx = fuse_get_context();
+int mongo_access(const char * path, int amode) {
     struct inode e;
+    uid_t uid;
+    gid_t gid;
     int res;
 
-    if(fcx->uid == 0)
+    get_caller(&uid, &gid);
+    if(uid == 0)
         return 0;
 
-    if((res = get_inode(path, &e)) != 0) {
+    if((res = get_inode_attrs(path, &e)) != 0) {
         if(res == -ENOENT && strcmp(path, "/") == 0) {
             res = mongo_mkdir("/", 0755);
         }
@@ -306,39 +324,96 @@ static int mongo_access(const char * path, int amode) {
     return res;
 }
 
-static int mongo_flush(const char * path, struct fuse_file_info * fi) {
+int mongo_flush(const char * path, struct fuse_file_info * fi) {
     struct inode * e = (struct inode*)fi->fh;
-    int res = 0;
+    int res = 0, failed;
+    if((res = flush_stage(e, 0, MAX_FILE_OFF)) != 0)
+        return res;
     pthread_mutex_lock(&e->wr_lock);
-    if(e->wr_extent) {
-        res = serialize_extent(e, e->wr_extent);
-        if(res != 0)
-            goto end;
-    }
+    // Blocks still being written behind have to land before any extent
+    // that points at them; this is also where their errors surface. The
+    // extents that did get stored are still worth keeping.
+    failed = wait_blocks(e, 1);
+    if((res = serialize_stored(e)) != 0)
+        goto end;
     res = commit_inode(e);
     if(res != 0)
         goto end;
     e->wr_age = time(NULL);
+    res = failed;
 end:
     pthread_mutex_unlock(&e->wr_lock);
     return res;
 }
 
-static int mongo_fsync(const char * path, int syncdata,
+int mongo_fsync(const char * path, int syncdata,
     struct fuse_file_info * fi) {
     return mongo_flush(path, fi);
 }
 
-static int mongo_release(const char * path, struct fuse_file_info * fi) {
+int mongo_release(const char * path, struct fuse_file_info * fi) {
     struct inode * e = (struct inode*)fi->fh;
+    int res;
+    // Flush has normally stored everything by now, but make sure nothing
+    // written since is lost.
+    flush_stage(e, 0, MAX_FILE_OFF);
+    pthread_mutex_lock(&e->wr_lock);
+    if((res = wait_blocks(e, 1)) != 0)
+        fprintf(stderr, "Error storing blocks on release: %d\n", res);
+    serialize_stored(e);
+    pthread_mutex_unlock(&e->wr_lock);
     free_inode(e);
     free(e);
-    return 0;
+    return res;
 }
 
-static void *mongo_initfs(struct fuse_conn_info * conn) {
+#ifndef ENOATTR
+#define ENOATTR ENODATA
+#endif
+
+/*
+ * The only extended attribute is a read-only view of the dedup counters,
+ * e.g. getfattr -n user.mongofuse.dedup /mnt
+ */
+#ifdef __APPLE__
+int mongo_getxattr(const char * path, const char * name,
+    char * value, size_t size, uint32_t position) {
+#else
+int mongo_getxattr(const char * path, const char * name,
+    char * value, size_t size) {
+#endif
+    char stats[256];
+    int len;
+
+    if(strcmp(name, "user.mongofuse.dedup") != 0)
+        return -ENOATTR;
+
+    len = dedup_stats(stats, sizeof(stats));
+    if(size == 0)
+        return len;
+    if(size < len)
+        return -ERANGE;
+    memcpy(value, stats, len);
+    return len;
+}
+
+void *mongo_initfs(struct fuse_conn_info * conn) {
     struct inode e;
-    int res = get_inode("/", &e);
+    int res;
+
+    // Background threads have to be started here rather than in main,
+    // since fuse_main forks when it daemonizes.
+    if(readahead_window > 0)
+        setup_readahead(readahead_window);
+    if(write_behind_depth > 0)
+        setup_write_behind(write_behind_depth, write_behind_batch);
+    if(dedup_seed)
+        seed_dedup();
+    start_stage_timer();
+    start_compactor();
+    ensure_indexes();
+
+    res = get_inode("/", &e);
     if(res != 0) {
          mongo_mkdir("/", 0755);
     } else
@@ -346,33 +421,154 @@ static void *mongo_initfs(struct fuse_conn_info * conn) {
     return NULL;
 }
 
+/*
+ * Every operation that talks to the database checks a connection out of
+ * the pool before it starts and returns it when it's done; see
+ * thread-stuff.c.
+ */
+#define POOLED(op, params, args) \
+static int pooled_##op params { \
+    int res = pool_enter(); \
+    if(res != 0) \
+        return res; \
+    res = mongo_##op args; \
+    pool_leave(); \
+    return res; \
+}
+
+typedef struct fuse_file_info ffi_t;
+POOLED(getattr, (const char * p, struct stat * st), (p, st))
+POOLED(readdir, (const char * p, void * buf, fuse_fill_dir_t filler,
+    off_t off, ffi_t * fi), (p, buf, filler, off, fi))
+POOLED(open, (const char * p, ffi_t * fi), (p, fi))
+POOLED(read, (const char * p, char * buf, size_t size, off_t off,
+    ffi_t * fi), (p, buf, size, off, fi))
+POOLED(write, (const char * p, const char * buf, size_t size, off_t off,
+    ffi_t * fi), (p, buf, size, off, fi))
+POOLED(create, (const char * p, mode_t mode, ffi_t * fi), (p, mode, fi))
+POOLED(truncate, (const char * p, off_t off), (p, off))
+POOLED(ftruncate, (const char * p, off_t off, ffi_t * fi), (p, off, fi))
+POOLED(mkdir, (const char * p, mode_t mode), (p, mode))
+POOLED(unlink, (const char * p), (p))
+POOLED(link, (const char * p, const char * np), (p, np))
+POOLED(chmod, (const char * p, mode_t mode), (p, mode))
+POOLED(chown, (const char * p, uid_t uid, gid_t gid), (p, uid, gid))
+POOLED(rmdir, (const char * p), (p))
+POOLED(utimens, (const char * p, const struct timespec tv[2]), (p, tv))
+POOLED(rename, (const char * p, const char * np), (p, np))
+POOLED(access, (const char * p, int amode), (p, amode))
+POOLED(symlink, (const char * p, const char * target), (p, target))
+POOLED(readlink, (const char * p, char * out, size_t len), (p, out, len))
+POOLED(flush, (const char * p, ffi_t * fi), (p, fi))
+POOLED(fsync, (const char * p, int datasync, ffi_t * fi), (p, datasync, fi))
+POOLED(release, (const char * p, ffi_t * fi), (p, fi))
+#if FUSE_VERSION >= 29
+POOLED(fallocate, (const char * p, int mode, off_t off, off_t len,
+    ffi_t * fi), (p, mode, off, len, fi))
+#endif
+
 static struct fuse_operations mongo_oper = {
-    .getattr    = mongo_getattr,
+    .getattr    = pooled_getattr,
     .fgetattr   = mongo_fgetattr,
-    .readdir    = mongo_readdir,
-    .open       = mongo_open,
-    .read       = mongo_read,
-    .write      = mongo_write,
-    .create     = mongo_create,
-    .truncate   = mongo_truncate,
-    .ftruncate  = mongo_ftruncate,
-    .mkdir      = mongo_mkdir,
-    .unlink     = mongo_unlink,
-    .link       = mongo_link,
-    .chmod      = mongo_chmod,
-    .chown      = mongo_chown,
-    .rmdir      = mongo_rmdir,
-    .utimens    = mongo_utimens,
-    .rename     = mongo_rename,
-    .access     = mongo_access,
-    .symlink    = mongo_symlink,
-    .readlink   = mongo_readlink,
-    .flush      = mongo_flush,
-    .fsync      = mongo_fsync,
-    .release    = mongo_release,
+    .readdir    = pooled_readdir,
+    .open       = pooled_open,
+    .read       = pooled_read,
+    .write      = pooled_write,
+    .create     = pooled_create,
+    .truncate   = pooled_truncate,
+    .ftruncate  = pooled_ftruncate,
+    .mkdir      = pooled_mkdir,
+    .unlink     = pooled_unlink,
+    .link       = pooled_link,
+    .chmod      = pooled_chmod,
+    .chown      = pooled_chown,
+    .rmdir      = pooled_rmdir,
+    .utimens    = pooled_utimens,
+    .rename     = pooled_rename,
+    .access     = pooled_access,
+    .symlink    = pooled_symlink,
+    .readlink   = pooled_readlink,
+    .flush      = pooled_flush,
+    .fsync      = pooled_fsync,
+    .release    = pooled_release,
+#if FUSE_VERSION >= 29
+    .fallocate  = pooled_fallocate,
+#endif
+    .getxattr   = mongo_getxattr,
     .init       = mongo_initfs
 };
 
+/*
+ * Mount profiles are sets of defaults tuned for one kind of workload;
+ * any option given explicitly still wins. Sizes are in KB like the
+ * options they stand for. The kernel options ask for big writes and reads
+ * so large blocks aren't split into 4KB requests, and the cache options
+ * only apply to the high-level API, since the low-level one takes its
+ * timeouts from metattl.
+ */
+struct mount_profile {
+    const char * name;
+    int blocksize;
+    int cachesize;
+    int readahead;
+    int wbdepth;
+    int wbbatch;
+    int metattl;
+    int poolsize;
+    int max_background;
+    const char * kernel_opts;
+    const char * cache_opts;
+};
+
+static const struct mount_profile profiles[] = {
+    { "throughput", 1024, 256, 8192, 64, 64, 1000, 32, 64,
+        "big_writes,max_write=131072,max_read=131072",
+        "attr_timeout=1,entry_timeout=1" },
+    { "latency", 64, 128, 512, 16, 1, 1000, 32, 16,
+        "big_writes,max_write=131072,max_read=131072",
+        "attr_timeout=1,entry_timeout=1" },
+    { "metadata", 64, 64, 256, 32, 32, 10000, 64, 32,
+        NULL,
+        "attr_timeout=10,entry_timeout=10,negative_timeout=10" },
+    { NULL }
+};
+
+static const struct mount_profile * find_profile(const char * name) {
+    const struct mount_profile * p;
+    for(p = profiles; p->name; p++) {
+        if(strcmp(p->name, name) == 0)
+            return p;
+    }
+    return NULL;
+}
+
+/* Puts the profile's FUSE options ahead of the user's so theirs win. */
+static void add_profile_opts(struct fuse_args * args,
+    const struct mount_profile * p, int lowlevel) {
+    char * opt;
+
+#ifndef __APPLE__
+    // big_writes, max_write and max_read only exist from FUSE 2.8 on.
+#if FUSE_VERSION >= 28
+    if(p->kernel_opts) {
+        asprintf(&opt, "-o%s", p->kernel_opts);
+        fuse_opt_insert_arg(args, 1, opt);
+        free(opt);
+    }
+#endif
+#if FUSE_VERSION >= 29
+    asprintf(&opt, "-omax_background=%d", p->max_background);
+    fuse_opt_insert_arg(args, 1, opt);
+    free(opt);
+#endif
+#endif
+    if(!lowlevel && p->cache_opts) {
+        asprintf(&opt, "-o%s", p->cache_opts);
+        fuse_opt_insert_arg(args, 1, opt);
+        free(opt);
+    }
+}
+
 void parse_args(struct fuse_args * rawargs) {
     // Struct for parsing args
     struct mongo_fuse_config {
@@ -382,7 +578,30 @@ void parse_args(struct fuse_args * rawargs) {
         int journal;
         int writeconcern;
         int majorityconcern;
+        int cachesize;
+        int readahead;
+        int wbdepth;
+        int wbbatch;
+        int dedupbloom;
+        int deduplru;
+        int dedupseed;
+        int nocoalesce;
+        int cdc;
+        int cdcavg;
+        int metattl;
+        int migrate;
+        int poolsize;
+        int aioconns;
+        int lowlevel;
+        char * hash;
+        char * codec;
+        int zstdlevel;
+        int blocksize;
+        char * profile;
+        int compact;
     } opts;
+    const struct mount_profile * profile = NULL;
+    struct fuse_args profile_args = FUSE_ARGS_INIT(rawargs->argc, rawargs->argv);
 
 #define MF_OPT(t, p, v) { t, offsetof(struct mongo_fuse_config, p), v }
 
@@ -393,11 +612,67 @@ void parse_args(struct fuse_args * rawargs) {
         MF_OPT("journal", journal, 1),
         MF_OPT("majority", majorityconcern, 1),
         MF_OPT("w=%i", writeconcern, 0),
+        MF_OPT("cachesize=%i", cachesize, 0),
+        MF_OPT("readahead=%i", readahead, 0),
+        MF_OPT("wbdepth=%i", wbdepth, 0),
+        MF_OPT("wbbatch=%i", wbbatch, 0),
+        MF_OPT("dedupbloom=%i", dedupbloom, 0),
+        MF_OPT("deduplru=%i", deduplru, 0),
+        MF_OPT("dedupseed", dedupseed, 1),
+        MF_OPT("nocoalesce", nocoalesce, 1),
+        MF_OPT("cdc", cdc, 1),
+        MF_OPT("cdcavg=%i", cdcavg, 0),
+        MF_OPT("metattl=%i", metattl, 0),
+        MF_OPT("migrate", migrate, 1),
+        MF_OPT("poolsize=%i", poolsize, 0),
+        MF_OPT("aioconns=%i", aioconns, 0),
+        MF_OPT("lowlevel", lowlevel, 1),
+        MF_OPT("hash=%s", hash, 0),
+        MF_OPT("codec=%s", codec, 0),
+        MF_OPT("zstdlevel=%i", zstdlevel, 0),
+        MF_OPT("blocksize=%i", blocksize, 0),
+        MF_OPT("profile=%s", profile, 0),
+        MF_OPT("compact=%i", compact, 0),
+        FUSE_OPT_END
+    };
+
+    static struct fuse_opt profile_opts[] = {
+        MF_OPT("profile=%s", profile, 0),
         FUSE_OPT_END
     };
 
     memset(&opts, 0, sizeof(opts));
     opts.writeconcern = 1;
+    opts.cachesize = 64;
+    opts.readahead = 1024;
+    opts.wbdepth = 32;
+    opts.wbbatch = 32;
+    opts.dedupbloom = 8;
+    opts.deduplru = 65536;
+    opts.cdcavg = 16;
+    opts.metattl = 1000;
+    opts.poolsize = 16;
+    opts.zstdlevel = 3;
+    opts.blocksize = 64;
+    opts.compact = 64;
+
+    // The profile has to be known before anything else is parsed, so
+    // that explicit options override its defaults.
+    fuse_opt_parse(&profile_args, &opts, profile_opts, NULL);
+    fuse_opt_free_args(&profile_args);
+    if(opts.profile) {
+        if((profile = find_profile(opts.profile)) == NULL) {
+            fprintf(stderr, "Unknown profile %s\n", opts.profile);
+            exit(1);
+        }
+        opts.blocksize = profile->blocksize;
+        opts.cachesize = profile->cachesize;
+        opts.readahead = profile->readahead;
+        opts.wbdepth = profile->wbdepth;
+        opts.wbbatch = profile->wbbatch;
+        opts.metattl = profile->metattl;
+        opts.poolsize = profile->poolsize;
+    }
     fuse_opt_parse(rawargs, &opts, mongo_fuse_opts, NULL);
 
     if(!opts.dbhost)
@@ -408,6 +683,7 @@ void parse_args(struct fuse_args * rawargs) {
     asprintf(&blocks_name, "%s.blocks", opts.blockdbname ? opts.blockdbname : opts.mddbname );
     asprintf(&inodes_name, "%s.inodes", opts.mddbname);
     asprintf(&extents_name, "%s.extents", opts.mddbname);
+    asprintf(&config_name, "%s.config", opts.mddbname);
     dbname = strdup(opts.mddbname);
     mongo_parse_host(opts.dbhost, &dbhost);
 
@@ -420,6 +696,64 @@ void parse_args(struct fuse_args * rawargs) {
     else
         mongo_write_concern_set_w(&write_concern, opts.writeconcern);
     mongo_write_concern_finish(&write_concern);
+
+    // Read-ahead only warms the block cache, so it's pointless without one.
+    if(opts.cachesize > 0) {
+        setup_block_cache(opts.cachesize);
+        readahead_window = (size_t)opts.readahead << 10;
+    }
+    write_behind_depth = opts.wbdepth;
+    write_behind_batch = opts.wbbatch;
+
+    setup_dedup(opts.dedupbloom, opts.deduplru);
+    dedup_seed = opts.dedupseed;
+
+    // New blocks are up to blocksize KB; blocks of any size up to 1MB
+    // can be read whatever this is set to.
+    if(opts.blocksize < 4 || opts.blocksize > (MAX_BLOCK_LIMIT >> 10) ||
+        opts.blocksize % 4 != 0) {
+        fprintf(stderr, "blocksize must be a multiple of 4 from 4 to %d\n",
+            MAX_BLOCK_LIMIT >> 10);
+        exit(1);
+    }
+    max_block_size = (size_t)opts.blocksize << 10;
+
+    // Content-defined chunking sizes are in KB and are rounded to a power
+    // of two no more than half of blocksize.
+    if(opts.cdc)
+        setup_chunking(STAGE_CDC, (size_t)opts.cdcavg << 10);
+    else if(!opts.nocoalesce)
+        setup_chunking(STAGE_FIXED, 0);
+
+    // Attributes are cached by path for metattl milliseconds; 0 turns the
+    // cache off.
+    setup_meta_cache(opts.metattl);
+    migrate_only = opts.migrate;
+
+    // Caps the connections used by FUSE threads; 0 gives each thread its
+    // own as before.
+    setup_pool(opts.poolsize);
+
+    // Files are compacted once this many extent documents have been
+    // written for them; 0 turns compaction off.
+    setup_compaction(opts.compact);
+
+    // Connections for pipelined block reads; they're opened on first use.
+    setup_aio(opts.aioconns);
+
+    // The low-level API lets the kernel cache lookups and attributes for
+    // as long as we cache them ourselves.
+    lowlevel_mode = opts.lowlevel;
+    setup_lowlevel(opts.metattl / 1000.0);
+    if(profile)
+        add_profile_opts(rawargs, profile, lowlevel_mode);
+
+    // Only used for new filesystems; existing ones keep their hash.
+    if(opts.hash && setup_hash(opts.hash) != 0)
+        exit(1);
+    // Blocks record their codec, so this can change between mounts.
+    if(setup_codec(opts.codec ? opts.codec : "snappy", opts.zstdlevel) != 0)
+        exit(1);
 }
 
 int main(int argc, char *argv[])
@@ -427,6 +761,19 @@ int main(int argc, char *argv[])
     struct fuse_args rawargs = FUSE_ARGS_INIT(argc, argv);
     parse_args(&rawargs);
     setup_threading();
+    setup_zeroscan();
+    // Upgrades the database in place and exits without mounting.
+    if(migrate_only)
+        return migrate_parents() == 0 ? 0 : 1;
+    if(check_schema() != 0)
+        return 1;
+    // The hash has to be settled before fuse_main forks, and the
+    // connection used for it mustn't be shared with the child.
+    if(load_hash_config() != 0)
+        return 1;
+    teardown_threading();
+    if(lowlevel_mode)
+        return lowlevel_main(&rawargs);
     int rc = fuse_main(rawargs.argc, rawargs.argv, &mongo_oper, NULL);
     return rc;
 }
@@ -3,9 +3,11 @@
 #include <mongo.h>
 #include <sys/types.h>
 #define FUSE_USE_VERSION 26
+// Room for the longest hash; see hash.c.
+#define HASH_LEN 32
 
 struct extent {
-    char hash[20];
+    char hash[HASH_LEN];
     uint64_t start;
     size_t size;
     char data[1];
@@ -13,11 +15,20 @@ struct extent {
 
 //#define BLOCKS_PER_EXTENT 2
 #define BLOCKS_PER_EXTENT 512
-#define MAX_BLOCK_SIZE 65536
+// New blocks are at most max_block_size bytes, set with -o blocksize, but
+// any mount can read blocks up to MAX_BLOCK_LIMIT.
+#define MAX_BLOCK_LIMIT (1 << 20)
+extern size_t max_block_size;
 #define TREE_HEIGHT_LIMIT 64
-#define HASH_LEN 20
 #define LEFT 0
 #define RIGHT 1
+#define MAX_FILE_OFF INT64_MAX
+#define FIELDS_ALL 0
+#define FIELDS_ATTRS 1
+#define FIELDS_LISTING 2
+#define STAGE_NONE 0
+#define STAGE_FIXED 1
+#define STAGE_CDC 2
 
 struct dirent {
     struct dirent * next;
@@ -26,19 +37,40 @@ struct dirent {
 };
 
 struct enode {
+    struct enode * link[2];
+    int level;
     off_t off;
     size_t len;
-    uint32_t seq;
+    // Offset into the block of this node's first byte, for blocks that
+    // were partially overwritten.
+    uint32_t blkoff;
     char empty;
     uint8_t hash[HASH_LEN];
 };
 
-struct elist {
+struct etree {
+    struct enode * root;
     size_t nnodes;
-    size_t nslots;
-    struct enode list[1];
 };
 
+struct etree_iter {
+    struct enode * stack[TREE_HEIGHT_LIMIT];
+    int top;
+    off_t end;
+};
+
+struct block_write {
+    const uint8_t * hash;
+    const char * data;
+    int32_t blk_offset;
+    size_t reallen;
+    size_t size;
+};
+
+// Extent versions one handle can write between checks for other writers
+// before it just reloads its extent map.
+#define RD_OWN_VERS 16
+
 struct inode {
     time_t updated;
     bson_oid_t oid;
@@ -53,30 +85,89 @@ struct inode {
     char * data;
     size_t datalen;
 
-    struct elist * wr_extent;
+    struct etree * wr_extent;
     pthread_mutex_t wr_lock;
     time_t wr_age;
+
+    struct etree * rd_extent;
+    int rd_nomap;
+    // Newest extent version in rd_extent, and the ones written since by
+    // this handle.
+    int64_t rd_ver;
+    int64_t rd_own[RD_OWN_VERS];
+    int rd_nown;
+    // Size as last read from the database, to notice truncation.
+    uint64_t db_size;
+
+    pthread_cond_t wb_cond;
+    int wb_pending;
+    int wb_error;
+    struct wb_job * wb_failed;
+    struct wb_extent * wb_order;
+    struct wb_extent * wb_order_tail;
+
+    off_t ra_next;
+    off_t ra_until;
+    int ra_hits;
+
+    pthread_mutex_t stage_lock;
+    char * stage;
+    size_t stage_len;
+    off_t stage_off;
+    time_t stage_age;
+    int staged;
+    struct inode * stage_next;
+    struct inode * stage_prev;
 };
 
 mongo * get_conn();
 void setup_threading();
 void teardown_threading();
+void setup_pool(int size);
+int pool_enter();
+void pool_leave();
+int set_caller(uid_t uid, gid_t gid);
+void clear_caller();
+void get_caller(uid_t * uid, gid_t * gid);
 char * get_compress_buf();
-char * get_extent_buf();
 
-int insert_hash(struct elist ** list, off_t off,
+void setup_block_cache(size_t megabytes);
+int block_cache_read(const uint8_t hash[HASH_LEN], size_t off, size_t len,
+    char * buf);
+int block_cache_dup(const uint8_t hash[HASH_LEN], char ** out, size_t * len);
+int block_cache_has(const uint8_t hash[HASH_LEN]);
+void block_cache_put(const uint8_t hash[HASH_LEN], const char * buf, size_t len);
+
+int insert_hash(struct etree ** tree, off_t off,
     size_t len, uint8_t hash[HASH_LEN]);
-int insert_empty(struct elist ** list, off_t off, size_t len);
+int insert_empty(struct etree ** tree, off_t off, size_t len);
+int insert_enode(struct etree ** tree, const struct enode * node);
+struct enode * etree_first(struct etree * tree, struct etree_iter * it,
+    off_t off, off_t end);
+struct enode * etree_next(struct etree_iter * it);
 int deserialize_extent(struct inode * e, off_t off,
-    size_t len, struct elist ** pout);
-int serialize_extent(struct inode * e, struct elist * list);
-struct elist * init_elist();
+    size_t len, struct etree ** pout);
+int serialize_extent(struct inode * e, struct etree * tree);
+int map_extent(struct inode * e, off_t off, size_t len, struct etree ** pout);
+void drop_extent_map(struct inode * e);
+void check_extent_map(struct inode * e, int truncated);
+int compact_extents(const bson_oid_t * oid, int64_t maxver);
+struct etree * init_etree();
+void clear_etree(struct etree * tree);
+void free_etree(struct etree * tree);
 
 void init_inode(struct inode * e);
 void free_inode(struct inode *e);
 int get_inode(const char * path, struct inode * out);
+int get_inode_by_oid(const bson_oid_t * oid, struct inode * out, int fields);
+int get_inode_impl(const char * path, struct inode * out, int fields);
+const bson * inode_fields(int which);
 int get_cached_inode(const char * path, struct inode * out);
 int commit_inode(struct inode * e);
+size_t parent_len(const char * path, size_t len);
+int ensure_indexes();
+int migrate_parents();
+int check_schema();
 int create_inode(const char * path, mode_t mode, const char * data);
 int check_access(struct inode * e, int amode);
 int read_inode(const bson * doc, struct inode * out);
@@ -87,9 +178,93 @@ int unlock_inode(struct inode * e, int writer, bson_date_t locktime);
 #endif
 
 int do_trunc(struct inode * e, off_t off);
+int prefetch_blocks(struct inode * e, off_t off, size_t len);
+int store_block(const uint8_t hash[HASH_LEN], const char * data,
+    int32_t blk_offset, size_t reallen, size_t size);
+int store_blocks(const struct block_write * blocks, int count);
+int write_block(struct inode * e, const char * buf, size_t size, off_t offset);
+
+// Zero runs this long or longer inside a block are stored as holes.
+#define ZERO_RUN_MIN 4096
+void setup_zeroscan();
+size_t trim_zeros(const char * buf, size_t len, size_t * start);
+int find_zero_run(const char * buf, size_t len,
+    size_t * start, size_t * runlen);
+
+void setup_chunking(int mode, size_t avg);
+void start_stage_timer();
+void drop_stage(struct inode * e);
+int chunking_enabled();
+int stage_write(struct inode * e, const char * buf, size_t size, off_t offset);
+int flush_stage(struct inode * e, off_t off, off_t end);
+
+#define CODEC_NONE 0
+#define CODEC_SNAPPY 1
+#define CODEC_LZ4 2
+#define CODEC_ZSTD 3
+int setup_codec(const char * name, int level);
+int codec_id(const char * name);
+const char * codec_name(int id);
+int compress_block(const char * data, size_t len,
+    const char ** out, size_t * outlen);
+int decompress_block(int id, const char * in, size_t inlen,
+    char * out, size_t * outlen);
+
+extern int hash_len;
+int setup_hash(const char * name);
+int load_hash_config();
+void hash_block(const char * buf, size_t size, uint8_t hash[HASH_LEN]);
+
+void setup_dedup(size_t bloom_mb, size_t lru_entries);
+void seed_dedup();
+int dedup_known(const uint8_t hash[HASH_LEN]);
+int dedup_maybe(const uint8_t hash[HASH_LEN]);
+void dedup_add(const uint8_t hash[HASH_LEN]);
+void dedup_count(int stored, int confirmed, int false_positives);
+int dedup_stats(char * buf, size_t len);
+
+void setup_write_behind(int depth, int batch);
+int queue_block(struct inode * e, const char * buf, size_t size,
+    off_t offset, int32_t blk_offset, size_t reallen);
+int queue_empty(struct inode * e, off_t offset, size_t size);
+void drop_queued_extents(struct inode * e);
+int wait_blocks(struct inode * e, int report);
+int serialize_stored(struct inode * e);
+
+void setup_compaction(int threshold);
+void start_compactor();
+void note_extent_docs(const bson_oid_t * oid, int ndocs);
+void note_extent_count(const bson_oid_t * oid, int ndocs);
+
+void setup_meta_cache(int ttl_ms);
+int get_inode_attrs(const char * path, struct inode * out);
+unsigned long meta_cache_seq();
+void meta_cache_put(const char * path, const struct inode * e,
+    unsigned long seq);
+void meta_cache_invalidate(const char * path);
+void meta_cache_invalidate_inode(const struct inode * e);
+void meta_cache_invalidate_tree(const char * path);
+
+// Blocks per pipelined query; 48 blocks of 64KB fit comfortably in a
+// reply, so larger blocks get proportionally fewer.
+#define AIO_CHUNK_BLOCKS ((int)(((size_t)48 << 16) / max_block_size))
+struct aio_req;
+void setup_aio(int count);
+int aio_enabled();
+struct aio_req * aio_query(const char * ns, const bson * query,
+    const bson * fields, int nreturn);
+int aio_wait(struct aio_req * req,
+    int (*cb)(const bson * doc, void * p), void * p);
+
+struct fuse_args;
+void setup_lowlevel(double timeout);
+int lowlevel_main(struct fuse_args * args);
+
+void setup_readahead(size_t window);
+void readahead_note(struct inode * e, off_t off, size_t len);
 
 int read_dirents(const char * directory,
     int (*dirent_cb)(struct inode *e, void * p,
-    const char * parent, size_t parentlen), void * p);
+    const char * parent, size_t parentlen), void * p, int fields);
 int snapshot_dir(const char * path, size_t pathlen, mode_t mode);
 
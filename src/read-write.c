@@ -5,6 +5,9 @@
 #include <string.h>
 #include <errno.h>
 #include <fcntl.h>
+#ifdef __linux__
+#include <linux/falloc.h>
+#endif
 #include <stdlib.h>
 #include <search.h>
 #include <time.h>
@@ -13,93 +16,348 @@
 #include <limits.h>
 #include <math.h>
 #include "mongo-fuse.h"
-#include <snappy-c.h>
-#ifdef __APPLE__
-#include <CommonCrypto/CommonDigest.h>
-#else
-#include <openssl/sha.h>
-#endif
-#include <xmmintrin.h>
 
 extern char * blocks_name;
 extern char * extents_name;
 extern char * inodes_name;
 
-static int resolve_block(struct inode * e, uint8_t hash[HASH_LEN], char * buf) {
-    bson query;
-    int res;
-    mongo_cursor curs;
+struct block_req {
+    const uint8_t * hash;
+    char * data;
+    size_t len;
+    // Where the one extent that wants this whole block goes in the read
+    // buffer, so it can be decompressed straight into place.
+    char * dst;
+    size_t dstlen;
+    int direct;
+};
+
+struct block_doc {
+    const uint8_t * hash;
+    const char * data;
+    size_t datalen;
+    uint32_t offset;
+    uint32_t size;
+    int codec;
+};
+
+static int block_req_cmp(const void * ra, const void * rb) {
+    const struct block_req * a = ra, * b = rb;
+    return memcmp(a->hash, b->hash, hash_len);
+}
+
+static int req_done(const struct block_req * r) {
+    return r->data || r->direct;
+}
+
+static int parse_block(const bson * doc, struct block_doc * out) {
     bson_iterator i;
     bson_type bt;
     const char * key;
-    mongo * conn = get_conn();
-
-    bson_init(&query);
-    bson_append_binary(&query, "_id", 0, (char*)hash, 20);
-    bson_finish(&query);
-
-    mongo_cursor_init(&curs, conn, blocks_name);
-    mongo_cursor_set_query(&curs, &query);
-    mongo_cursor_set_limit(&curs, 1);
-
-    res = mongo_cursor_next(&curs);
-    bson_destroy(&query);
-    if(res != MONGO_OK) {
-        mongo_cursor_destroy(&curs);
-        return -EIO;
-    }
-
-    bson_iterator_init(&i, mongo_cursor_bson(&curs));
-    size_t outsize, compsize = 0;
-    const char * compdata = NULL;
-    uint32_t offset = 0, size = 0;
 
+    memset(out, 0, sizeof(struct block_doc));
+    out->codec = CODEC_SNAPPY;
+    bson_iterator_init(&i, doc);
     while((bt = bson_iterator_next(&i)) > 0) {
         key = bson_iterator_key(&i);
-        if(strcmp(key, "data") == 0) {
-            compsize = bson_iterator_bin_len(&i);
-            compdata = bson_iterator_bin_data(&i);
+        if(strcmp(key, "_id") == 0)
+            out->hash = (const uint8_t*)bson_iterator_bin_data(&i);
+        else if(strcmp(key, "data") == 0) {
+            out->datalen = bson_iterator_bin_len(&i);
+            out->data = bson_iterator_bin_data(&i);
         }
         else if(strcmp(key, "offset") == 0)
-            offset = bson_iterator_int(&i);
+            out->offset = bson_iterator_int(&i);
         else if(strcmp(key, "size") == 0)
-            size = bson_iterator_int(&i);
+            out->size = bson_iterator_int(&i);
+        else if(strcmp(key, "codec") == 0)
+            out->codec = codec_id(bson_iterator_string(&i));
     }
 
-    if(curs.err != MONGO_CURSOR_EXHAUSTED) {
-        fprintf(stderr, "Error getting extents %d", curs.err);
+    if(!out->data) {
+        fprintf(stderr, "No data in block?\n");
         return -EIO;
     }
-
-    if(!compdata) {
-        fprintf(stderr, "No data in block?\n");
+    if(out->offset > MAX_BLOCK_LIMIT) {
+        fprintf(stderr, "Bad offset in block\n");
         return -EIO;
     }
+    return 0;
+}
+
+/* Decompresses a block into buf, which has room for cap bytes. */
+static int decode_block(const struct block_doc * b, char * buf, size_t cap,
+    size_t * outlen) {
+    size_t outsize, len;
+    uint32_t size = b->size;
+    int res;
 
-    outsize = MAX_BLOCK_SIZE;
-    if((res = snappy_uncompress(compdata, compsize,
-        buf + offset, &outsize)) != SNAPPY_OK) {
-        fprintf(stderr, "Error uncompressing block %d\n", res);
+    if(b->offset > cap)
         return -EIO;
+    outsize = cap - b->offset;
+    if((res = decompress_block(b->codec, b->data, b->datalen,
+        buf + b->offset, &outsize)) != 0)
+        return res;
+    if(b->offset > 0)
+        memset(buf, 0, b->offset);
+    len = outsize + b->offset;
+    if(len < size)
+        memset(buf + len, 0, size - len);
+    else
+        size = len;
+    *outlen = size;
+    return 0;
+}
+
+struct block_fill {
+    struct block_req * reqs;
+    size_t nreqs;
+    size_t filled;
+};
+
+/* Fills in whichever request doc is the block for. */
+static int fill_block(const bson * doc, void * p) {
+    struct block_fill * bf = p;
+    struct block_req key, * r;
+    struct block_doc b;
+    size_t len, cap;
+    int res;
+
+    if((res = parse_block(doc, &b)) != 0)
+        return res;
+    key.hash = b.hash;
+    if(!b.hash || !(r = bsearch(&key, bf->reqs, bf->nreqs,
+        sizeof(struct block_req), block_req_cmp)) || req_done(r))
+        return 0;
+
+    if(r->dst && b.size == r->dstlen) {
+        if((res = decode_block(&b, r->dst, r->dstlen, &len)) != 0)
+            return res;
+        r->direct = 1;
+        block_cache_put(r->hash, r->dst, len);
+    } else {
+        // The block may be bigger than this mount would write.
+        cap = b.size > 0 && b.size <= MAX_BLOCK_LIMIT ? b.size : MAX_BLOCK_LIMIT;
+        if((r->data = malloc(cap)) == NULL)
+            return -ENOMEM;
+        if((res = decode_block(&b, r->data, cap, &len)) != 0) {
+            free(r->data);
+            r->data = NULL;
+            return res;
+        }
+        r->len = len;
+        block_cache_put(r->hash, r->data, len);
     }
-    if(offset > 0)
-        memset(buf, 0, offset);
-    compsize = outsize + offset;
-    if(compsize < size)
-        memset(buf + compsize, 0, size - compsize);
+    bf->filled++;
+    return 0;
+}
+
+/*
+ * Builds an _id $in query for up to max of the requests from *idx on
+ * that don't have their data yet, leaving *idx after the last one used.
+ */
+static void build_block_query(bson * query, struct block_req * reqs,
+    size_t nreqs, size_t * idx, size_t max) {
+    char idxstr[24];
+    size_t n = 0;
+
+    bson_init(query);
+    bson_append_start_object(query, "_id");
+    bson_append_start_array(query, "$in");
+    for(; *idx < nreqs && n < max; (*idx)++) {
+        if(req_done(&reqs[*idx]))
+            continue;
+        bson_numstr(idxstr, n++);
+        bson_append_binary(query, idxstr, 0,
+            (const char*)reqs[*idx].hash, hash_len);
+    }
+    bson_append_finish_array(query);
+    bson_append_finish_object(query);
+    bson_finish(query);
+}
+
+/*
+ * Sends every chunk of the query at once over the pipelined connections
+ * and then collects the replies, so a large read costs about one round
+ * trip however many chunks it takes. Chunks are small enough that their
+ * blocks should fit in a single reply; anything that doesn't come back
+ * is left for the caller to fetch the ordinary way.
+ */
+static int fetch_blocks_pipelined(struct block_fill * bf, size_t nmissing) {
+    size_t nchunks = (nmissing + AIO_CHUNK_BLOCKS - 1) / AIO_CHUNK_BLOCKS;
+    struct aio_req ** pending;
+    size_t idx = 0, c;
+    bson query;
+    int res, err = 0;
+
+    if((pending = calloc(nchunks, sizeof(struct aio_req*))) == NULL)
+        return -ENOMEM;
+    for(c = 0; c < nchunks; c++) {
+        build_block_query(&query, bf->reqs, bf->nreqs, &idx,
+            AIO_CHUNK_BLOCKS);
+        pending[c] = aio_query(blocks_name, &query, NULL, -AIO_CHUNK_BLOCKS);
+        bson_destroy(&query);
+    }
+    for(c = 0; c < nchunks; c++) {
+        if(!pending[c])
+            continue;
+        if((res = aio_wait(pending[c], fill_block, bf)) != 0 && err == 0)
+            err = res;
+    }
+    free(pending);
+    return err;
+}
+
+/*
+ * Fills in the data for every request in reqs, which must be sorted by
+ * hash and contain no duplicates. Blocks that aren't in the block cache
+ * are fetched with a single $in query rather than one query per block,
+ * or as pipelined chunks of one if that's enabled.
+ */
+static int resolve_blocks(struct block_req * reqs, size_t nreqs) {
+    bson query;
+    mongo_cursor curs;
+    mongo * conn;
+    struct block_fill bf = { reqs, nreqs, 0 };
+    size_t idx, nmissing = 0;
+    int err = 0;
+
+    for(idx = 0; idx < nreqs; idx++) {
+        struct block_req * r = &reqs[idx];
+        if((err = block_cache_dup(r->hash, &r->data, &r->len)) == -ENOMEM)
+            return err;
+        if(err != 0)
+            nmissing++;
+    }
+    err = 0;
+
+    if(nmissing == 0)
+        return 0;
+
+    if(aio_enabled()) {
+        // Errors here are from the connection, not the data, so fall
+        // back to the driver for whatever is still missing.
+        if(fetch_blocks_pipelined(&bf, nmissing) == -ENOMEM)
+            return -ENOMEM;
+        nmissing -= bf.filled;
+        bf.filled = 0;
+        if(nmissing == 0)
+            return 0;
+    }
+
+    idx = 0;
+    build_block_query(&query, reqs, nreqs, &idx, nreqs);
+
+    conn = get_conn();
+    mongo_cursor_init(&curs, conn, blocks_name);
+    mongo_cursor_set_query(&curs, &query);
+
+    while(mongo_cursor_next(&curs) == MONGO_OK) {
+        if((err = fill_block(mongo_cursor_bson(&curs), &bf)) != 0)
+            break;
+    }
+    nmissing -= bf.filled;
+    bson_destroy(&query);
     mongo_cursor_destroy(&curs);
 
+    if(err != 0)
+        return err;
+    if(curs.err != MONGO_CURSOR_EXHAUSTED) {
+        fprintf(stderr, "Error getting blocks %d\n", curs.err);
+        return -EIO;
+    }
+    if(nmissing > 0) {
+        fprintf(stderr, "Missing %lu blocks\n", (unsigned long)nmissing);
+        return -EIO;
+    }
     return 0;
 }
 
+/*
+ * Returns the distinct, sorted set of blocks that the nodes of list
+ * overlapping [off, end) refer to. If skip_cached is set, blocks that
+ * are already in the block cache are left out.
+ */
+static struct block_req * collect_blocks(struct etree * list, off_t off,
+    off_t end, size_t * pcount, int skip_cached) {
+    struct block_req * reqs;
+    struct etree_iter it;
+    struct enode * cur;
+    size_t idx, nreqs = 0, ndistinct;
+
+    reqs = malloc(sizeof(struct block_req) * (list->nnodes + 1));
+    if(!reqs)
+        return NULL;
+
+    for(cur = etree_first(list, &it, off, end); cur; cur = etree_next(&it)) {
+        if(cur->empty)
+            continue;
+        if(skip_cached && block_cache_has(cur->hash))
+            continue;
+        memset(&reqs[nreqs], 0, sizeof(struct block_req));
+        reqs[nreqs].hash = cur->hash;
+        nreqs++;
+    }
+    qsort(reqs, nreqs, sizeof(struct block_req), block_req_cmp);
+    for(idx = 1, ndistinct = nreqs > 0; idx < nreqs; idx++) {
+        if(block_req_cmp(&reqs[idx], &reqs[ndistinct - 1]) != 0)
+            reqs[ndistinct++] = reqs[idx];
+    }
+
+    *pcount = ndistinct;
+    return reqs;
+}
+
+static void free_blocks(struct block_req * reqs, size_t count) {
+    size_t idx;
+    for(idx = 0; idx < count; idx++)
+        free(reqs[idx].data);
+    free(reqs);
+}
+
+int prefetch_blocks(struct inode * e, off_t off, size_t len) {
+    struct etree * list = NULL;
+    struct block_req * reqs;
+    size_t count;
+    int res;
+
+    if((res = deserialize_extent(e, off, len, &list)) != 0)
+        return res;
+    if(!list)
+        return 0;
+
+    if((reqs = collect_blocks(list, off, off + len, &count, 1)) == NULL) {
+        free_etree(list);
+        return -ENOMEM;
+    }
+
+    res = resolve_blocks(reqs, count);
+    free_blocks(reqs, count);
+    free_etree(list);
+    return res;
+}
+
+/* Works out which part of cur falls in [off, end) and where it goes. */
+static void node_slice(const struct enode * cur, off_t off, off_t end,
+    size_t * inskip, size_t * outskip, size_t * tocopy) {
+    const off_t curend = cur->off + cur->len;
+
+    *inskip = cur->off < off ? off - cur->off : 0;
+    *outskip = cur->off > off ? cur->off - off : 0;
+    *tocopy = (end > curend ? curend : end) - (cur->off + *inskip);
+}
+
 int mongo_read(const char *path, char *buf, size_t size, off_t offset,
                struct fuse_file_info *fi) {
     struct inode * e;
     int res;
     const off_t end = size + offset;
-    size_t idx;
-    struct elist * list = NULL;
-    char * extent_buf = get_extent_buf();
+    off_t pos = offset;
+    size_t idx, nreqs = 0, ndistinct = 0, inskip, outskip, tocopy;
+    struct etree * list = NULL;
+    struct etree_iter it;
+    struct enode * cur;
+    struct block_req * reqs;
 
     e = (struct inode*)fi->fh;
     if((res = get_cached_inode(path, e)) != 0)
@@ -108,58 +366,104 @@ int mongo_read(const char *path, char *buf, size_t size, off_t offset,
     if(e->mode & S_IFDIR)
         return -EISDIR;
 
+    // Staged writes we're about to read back have to be stored first.
+    if((res = flush_stage(e, offset, end)) != 0)
+        return res;
+
     pthread_mutex_lock(&e->wr_lock);
-    if(e->wr_extent) {
-        if((res = serialize_extent(e, e->wr_extent)) != 0) {
-            pthread_mutex_unlock(&e->wr_lock);
-            return res;
-        }
-        e->wr_extent->nnodes = 0;
+    if((res = wait_blocks(e, 0)) != 0 ||
+        (res = serialize_stored(e)) != 0) {
+        pthread_mutex_unlock(&e->wr_lock);
+        return res;
     }
     e->wr_age = time(NULL);
     pthread_mutex_unlock(&e->wr_lock);
 
-    if((res = deserialize_extent(e, offset, size, &list)) != 0)
+    readahead_note(e, offset, size);
+
+    if((res = map_extent(e, offset, size, &list)) != 0)
         return res;
 
-    if(list->nnodes == 0) {
+    if(!list || list->nnodes == 0) {
         memset(buf, 0, size);
-        free(list);
+        free_etree(list);
         return size;
     }
 
-    if(list->list[0].off > offset)
-        memset(buf, 0, list->list[0].off - offset);
+    if((reqs = malloc(sizeof(struct block_req) * list->nnodes)) == NULL) {
+        free_etree(list);
+        return -ENOMEM;
+    }
 
-    for(idx = 0; idx < list->nnodes; idx++) {
-        const struct enode * cur = &list->list[idx];
-        const off_t curend = cur->off + cur->len;
-        size_t inskip = 0, tocopy = cur->len, outskip = 0;
- 
-        if(cur->off > end || curend < offset)
-            continue;
+    // Holes, and slices of blocks the block cache has, go straight into
+    // buf. Whatever's left is fetched below.
+    for(cur = etree_first(list, &it, offset, end); cur; cur = etree_next(&it)) {
+        node_slice(cur, offset, end, &inskip, &outskip, &tocopy);
+
+        // Nothing has been written to the gap since the last node.
+        if(cur->off > pos)
+            memset(buf + (pos - offset), 0, cur->off - pos);
+        pos = cur->off + inskip + tocopy;
 
- 
-        if(cur->off < offset)
-            inskip = offset - cur->off;
-        if(cur->off > offset)
-            outskip = cur->off - offset;
-        tocopy = end > curend ? curend : end;
-        tocopy -= (cur->off + inskip);
- 
         if(cur->empty) {
             memset(buf + outskip, 0, tocopy);
             continue;
         }
- 
-        res = resolve_block(e, (uint8_t*)cur->hash, extent_buf);
-        if(res != 0)
-            return res;
-        memcpy(buf + outskip, extent_buf + inskip, tocopy);
+        if(block_cache_read(cur->hash, cur->blkoff + inskip, tocopy,
+            buf + outskip) == 0)
+            continue;
+
+        memset(&reqs[nreqs], 0, sizeof(struct block_req));
+        reqs[nreqs].hash = cur->hash;
+        if(inskip == 0 && cur->blkoff == 0) {
+            reqs[nreqs].dst = buf + outskip;
+            reqs[nreqs].dstlen = tocopy;
+        }
+        nreqs++;
+    }
+    if(pos < end)
+        memset(buf + (pos - offset), 0, end - pos);
+
+    qsort(reqs, nreqs, sizeof(struct block_req), block_req_cmp);
+    for(idx = 1, ndistinct = nreqs > 0; idx < nreqs; idx++) {
+        if(block_req_cmp(&reqs[idx], &reqs[ndistinct - 1]) != 0)
+            reqs[ndistinct++] = reqs[idx];
+        else
+            reqs[ndistinct - 1].dst = NULL;
     }
 
-    free(list);
-    return size;
+    if(ndistinct > 0 && (res = resolve_blocks(reqs, ndistinct)) != 0)
+        goto end;
+
+    for(cur = etree_first(list, &it, offset, end); ndistinct > 0 && cur;
+        cur = etree_next(&it)) {
+        struct block_req key, * block;
+
+        if(cur->empty)
+            continue;
+        key.hash = cur->hash;
+        // Not there means it came from the cache, and direct means it was
+        // decompressed in place.
+        block = bsearch(&key, reqs, ndistinct,
+            sizeof(struct block_req), block_req_cmp);
+        if(!block || block->direct)
+            continue;
+
+        node_slice(cur, offset, end, &inskip, &outskip, &tocopy);
+        inskip += cur->blkoff;
+        if(inskip + tocopy > block->len) {
+            fprintf(stderr, "Block is shorter than its extent entry\n");
+            res = -EIO;
+            goto end;
+        }
+        memcpy(buf + outskip, block->data + inskip, tocopy);
+    }
+    res = size;
+
+end:
+    free_blocks(reqs, ndistinct);
+    free_etree(list);
+    return res;
 }
 
 int update_filesize(struct inode * e, off_t newsize) {
@@ -167,10 +471,14 @@ int update_filesize(struct inode * e, off_t newsize) {
     mongo * conn = get_conn();
     int res;
 
-    if(newsize < e->size)
+    // Only writes that grow the file need to touch the inode.
+    pthread_mutex_lock(&e->wr_lock);
+    if(newsize <= e->size) {
+        pthread_mutex_unlock(&e->wr_lock);
         return 0;
-
+    }
     e->size = newsize;
+    pthread_mutex_unlock(&e->wr_lock);
 
     bson_init(&cond);
     bson_append_oid(&cond, "_id", &e->oid);
@@ -185,103 +493,53 @@ int update_filesize(struct inode * e, off_t newsize) {
     res = mongo_update(conn, inodes_name, &cond, &doc, 0, NULL);
     bson_destroy(&cond);
     bson_destroy(&doc);
+    meta_cache_invalidate_inode(e);
 
     if(res != 0)
         return -EIO;
     return 0;
 }
 
-int mongo_write(const char *path, const char *buf, size_t size,
-                off_t offset, struct fuse_file_info *fi)
-{
-    struct inode * e;
-    int res;
-    size_t reallen;
-    int32_t realend = size, blk_offset = 0;
-    const off_t write_end = size + offset;
-    char * lock;
+static int append_block(bson * doc, const char * data,
+    int32_t blk_offset, size_t reallen, size_t size) {
+    const char * comp_out;
+    size_t comp_size;
+    int id;
+
+    if((id = compress_block(data, reallen, &comp_out, &comp_size)) < 0)
+        return id;
+
+    bson_append_binary(doc, "data", 0, comp_out, comp_size);
+    // No codec means snappy, as it did before there was a choice.
+    if(id != CODEC_SNAPPY)
+        bson_append_string(doc, "codec", codec_name(id));
+    bson_append_int(doc, "offset", blk_offset);
+    bson_append_int(doc, "size", size);
+    bson_append_time_t(doc, "created", time(NULL));
+    return 0;
+}
+
+/*
+ * Compresses and upserts a single block. data points at the reallen
+ * non-zero bytes that start blk_offset bytes into the size-byte block.
+ */
+int store_block(const uint8_t hash[HASH_LEN], const char * data,
+    int32_t blk_offset, size_t reallen, size_t size) {
     bson doc, cond;
     mongo * conn = get_conn();
-    uint8_t hash[20];
-    time_t now = time(NULL);
-
-    e = (struct inode*)fi->fh;
-    if((res = get_cached_inode(path, e)) != 0)
-        return res;
-
-    if(e->mode & S_IFDIR)
-        return -EISDIR;
-
-    /* Uncomment this for incredibly slow length calculations.
-    for(;realend >= 0 && buf[realend] == '\0'; realend--);
-    realend++;
-    for(blk_offset = 0; blk_offset < realend && buf[blk_offset] == 0; blk_offset++);
-    blk_offset -= blk_offset > 0 ? 1 : 0;
-    * The code below uses SSE4 instructions to find the first/last
-    * zero bytes by doing 16-byte comparisons at a time. This should give
-    * a ~16 speed boost on blocks with lots of zero bytes over the dumb
-    * method above.
-    */
-    
-    if(size >= 16) {
-        __m128i zero = _mm_setzero_si128();
-        lock = (char*)buf + size - 16;
-        while(lock >= buf) {
-            __m128i x = _mm_loadu_si128((__m128i*)lock);
-            res = _mm_movemask_epi8(_mm_cmpeq_epi8(zero, x));
-            if(res == 0xffff) {
-                lock -= 16;
-                continue;
-            }
-            realend = lock - buf + fls(res ^ 0xffff);
-            break;
-        }
-        if(lock <= buf)
-            realend = 0;
-
-        lock = (char*)buf;
-        while(lock - buf < realend) {
-            __m128i x = _mm_loadu_si128((__m128i*)lock);
-            res = _mm_movemask_epi8(_mm_cmpeq_epi8(zero, x));
-            if(res == 0xffff) {
-                lock += 16;
-                continue;
-            }
-            blk_offset = lock - buf + ffs(res ^ 0xffff) - 1;
-            break;
-        }
-    }
-
-    reallen = realend - blk_offset;
-    if(reallen == 0) {
-        pthread_mutex_lock(&e->wr_lock);
-        res = insert_empty(&e->wr_extent, offset, size);
-        goto end;
-    }
-
-#ifdef __APPLE__
-    CC_SHA1(buf, size, hash);
-#else
-    SHA1(buf, size, hash);
-#endif
+    int res;
 
     bson_init(&cond);
-    bson_append_binary(&cond, "_id", 0, (char*)hash, sizeof(hash));
+    bson_append_binary(&cond, "_id", 0, (const char*)hash, hash_len);
     bson_finish(&cond);
 
     bson_init(&doc);
     bson_append_start_object(&doc, "$setOnInsert");
-    char * comp_out = get_compress_buf();
-    size_t comp_size = snappy_max_compressed_length(reallen);
-    if((res = snappy_compress(buf + blk_offset, reallen,
-        comp_out, &comp_size)) != SNAPPY_OK) {
-        fprintf(stderr, "Error compressing input: %d\n", res);
-        return -EIO;
+    if((res = append_block(&doc, data, blk_offset, reallen, size)) != 0) {
+        bson_destroy(&doc);
+        bson_destroy(&cond);
+        return res;
     }
-    bson_append_binary(&doc, "data", 0, comp_out, comp_size);
-    bson_append_int(&doc, "offset", blk_offset);
-    bson_append_int(&doc, "size", size);
-    bson_append_time_t(&doc, "created", now);
     bson_append_finish_object(&doc);
     bson_finish(&doc);
 
@@ -294,16 +552,223 @@ int mongo_write(const char *path, const char *buf, size_t size,
         fprintf(stderr, "Error committing block %s\n", conn->lasterrstr);
         return -EIO;
     }
+    return 0;
+}
 
-    pthread_mutex_lock(&e->wr_lock);
-    res = insert_hash(&e->wr_extent, offset, size, hash);
+/*
+ * Marks the blocks the dedup filter thinks might already be stored, and
+ * confirms them with a single _id-only query. With recheck, every block
+ * not yet marked is looked up, whatever the filter says.
+ */
+static int find_stored(const struct block_write * blocks, int count,
+    char * present, int recheck) {
+    bson query, fields;
+    bson_iterator i;
+    mongo_cursor curs;
+    char idxstr[24];
+    int idx, nmaybe = 0, nfound = 0;
+
+    bson_init(&query);
+    bson_append_start_object(&query, "_id");
+    bson_append_start_array(&query, "$in");
+    for(idx = 0; idx < count; idx++) {
+        if(present[idx] || (!recheck && !dedup_maybe(blocks[idx].hash)))
+            continue;
+        bson_numstr(idxstr, nmaybe++);
+        bson_append_binary(&query, idxstr, 0,
+            (const char*)blocks[idx].hash, hash_len);
+    }
+    bson_append_finish_array(&query);
+    bson_append_finish_object(&query);
+    bson_finish(&query);
+
+    if(nmaybe == 0) {
+        bson_destroy(&query);
+        return 0;
+    }
+
+    bson_init(&fields);
+    bson_append_int(&fields, "_id", 1);
+    bson_finish(&fields);
+
+    mongo_cursor_init(&curs, get_conn(), blocks_name);
+    mongo_cursor_set_query(&curs, &query);
+    mongo_cursor_set_fields(&curs, &fields);
+
+    while(mongo_cursor_next(&curs) == MONGO_OK) {
+        const char * hash;
+        if(bson_find(&i, mongo_cursor_bson(&curs), "_id") != BSON_BINDATA)
+            continue;
+        hash = bson_iterator_bin_data(&i);
+        for(idx = 0; idx < count; idx++) {
+            if(!present[idx] &&
+                memcmp(blocks[idx].hash, hash, hash_len) == 0) {
+                present[idx] = 1;
+                nfound++;
+            }
+        }
+    }
+    bson_destroy(&query);
+    bson_destroy(&fields);
+    mongo_cursor_destroy(&curs);
+
+    // If the lookup failed we just write everything. Anything a recheck
+    // did find is stored, though.
+    if(curs.err != MONGO_CURSOR_EXHAUSTED) {
+        if(!recheck) {
+            memset(present, 0, count);
+            nfound = 0;
+        }
+        return nfound;
+    }
+    if(!recheck)
+        dedup_count(0, nfound, nmaybe - nfound);
+    return nfound;
+}
+
+/*
+ * Stores several blocks with one multi-document insert, skipping any
+ * that turn out to be stored already. The insert carries on past errors
+ * but only reports the last one, so after any error, even a duplicate
+ * key from another writer getting there first, the blocks are looked up
+ * again and whichever are missing are upserted one at a time.
+ */
+int store_blocks(const struct block_write * blocks, int count) {
+    const bson ** docs;
+    bson * storage;
+    char * present;
+    mongo * conn;
+    int i, res = 0, built = 0, nstore, last = 0;
+
+    docs = malloc(count * (sizeof(bson*) + sizeof(bson) + 1));
+    if(!docs)
+        return -ENOMEM;
+    storage = (bson*)(docs + count);
+    present = (char*)(storage + count);
+    memset(present, 0, count);
+
+    nstore = count - find_stored(blocks, count, present, 0);
+    for(i = 0; i < count; i++) {
+        if(!present[i])
+            last = i;
+    }
+
+    if(nstore == 0)
+        goto end;
+    if(nstore == 1) {
+        res = store_block(blocks[last].hash, blocks[last].data,
+            blocks[last].blk_offset, blocks[last].reallen, blocks[last].size);
+        goto end;
+    }
+
+    for(i = 0; i < count; i++) {
+        const struct block_write * b = &blocks[i];
+        if(present[i])
+            continue;
+        bson_init(&storage[built]);
+        bson_append_binary(&storage[built], "_id", 0,
+            (const char*)b->hash, hash_len);
+        res = append_block(&storage[built], b->data,
+            b->blk_offset, b->reallen, b->size);
+        bson_finish(&storage[built]);
+        docs[built] = &storage[built];
+        built++;
+        if(res != 0)
+            goto end;
+    }
+
+    conn = get_conn();
+    res = mongo_insert_batch(conn, blocks_name, docs, built,
+        NULL, MONGO_CONTINUE_ON_ERROR);
+    if(res != MONGO_OK) {
+        if(conn->lasterrcode != 11000 && conn->lasterrcode != 11001)
+            fprintf(stderr, "Error inserting %d blocks, retrying singly: "
+                "%s\n", built, conn->lasterrstr);
+        find_stored(blocks, count, present, 1);
+        for(i = 0, res = 0; i < count && res == 0; i++) {
+            if(!present[i])
+                res = store_block(blocks[i].hash, blocks[i].data,
+                    blocks[i].blk_offset, blocks[i].reallen, blocks[i].size);
+        }
+    }
 
 end:
-    if(write_end > e->size)
-        e->size = write_end;
+    if(res == 0) {
+        for(i = 0; i < count; i++)
+            dedup_add(blocks[i].hash);
+        dedup_count(nstore, 0, 0);
+    }
+    for(i = 0; i < built; i++)
+        bson_destroy(&storage[i]);
+    free(docs);
+    return res;
+}
+
+static int write_segment(struct inode * e, const char * buf, size_t size,
+    off_t offset) {
+    size_t start, end;
+
+    if((end = trim_zeros(buf, size, &start)) == 0)
+        return queue_empty(e, offset, size);
+    return queue_block(e, buf, size, offset, start, end - start);
+}
+
+/*
+ * Stores one block of file data at offset and adds it to the inode's
+ * pending extents, leaving any long runs of zeros in it as holes. Must be
+ * called without wr_lock held.
+ */
+int write_block(struct inode * e, const char * buf, size_t size, off_t offset) {
+    size_t pos = 0, start, len;
+    int res;
+
+    while(find_zero_run(buf + pos, size - pos, &start, &len)) {
+        if(start > 0 &&
+            (res = write_segment(e, buf + pos, start, offset + pos)) != 0)
+            return res;
+        if((res = queue_empty(e, offset + pos + start, len)) != 0)
+            return res;
+        pos += start + len;
+    }
+    if(pos < size)
+        return write_segment(e, buf + pos, size - pos, offset + pos);
+    return 0;
+}
+
+int mongo_write(const char *path, const char *buf, size_t size,
+                off_t offset, struct fuse_file_info *fi)
+{
+    struct inode * e;
+    int res;
+    const off_t write_end = size + offset;
+    time_t now = time(NULL);
+    size_t done, n;
+
+    e = (struct inode*)fi->fh;
+    if((res = get_cached_inode(path, e)) != 0)
+        return res;
+
+    if(e->mode & S_IFDIR)
+        return -EISDIR;
+
+    if(chunking_enabled())
+        res = stage_write(e, buf, size, offset);
+    else {
+        // big_writes can hand us more than a block at a time.
+        for(done = 0; res == 0 && done < size; done += n) {
+            n = size - done > max_block_size ? max_block_size : size - done;
+            res = write_block(e, buf + done, n, offset + done);
+        }
+    }
+    if(res != 0)
+        return res;
+
+    pthread_mutex_lock(&e->wr_lock);
+    e->modified = now;
 
     if(now - e->wr_age > 3) {
-        res = serialize_extent(e, e->wr_extent);
+        if((res = wait_blocks(e, 0)) == 0)
+            res = serialize_stored(e);
         if(res != 0) {
             pthread_mutex_unlock(&e->wr_lock);
             return res;    
@@ -331,12 +796,26 @@ int do_trunc(struct inode * e, off_t off) {
         return 0;
     }
 
+    if((res = flush_stage(e, 0, MAX_FILE_OFF)) != 0)
+        return res;
+
     pthread_mutex_lock(&e->wr_lock);
+    // Queued blocks would otherwise land in the extents after we clear
+    // them.
+    if((res = wait_blocks(e, 0)) != 0 && off != 0) {
+        pthread_mutex_unlock(&e->wr_lock);
+        return res;
+    }
     if(e->wr_extent) {
-        if(off < 0 && (res = serialize_extent(e, e->wr_extent)) != 0)
+        if(off < 0 && (res = serialize_stored(e)) != 0) {
+            pthread_mutex_unlock(&e->wr_lock);
             return res;
-        e->wr_extent->nnodes = 0;
+        }
+        clear_etree(e->wr_extent);
     }
+    if(off == 0)
+        wait_blocks(e, 1);
+    drop_extent_map(e);
     e->wr_age = time(NULL);
     pthread_mutex_unlock(&e->wr_lock);
 
@@ -360,3 +839,62 @@ int do_trunc(struct inode * e, off_t off) {
 
     return 0;
 }
+
+/*
+ * Holes are free here, so preallocating just extends the file and
+ * punching a hole records the range as empty, in at most HOLE_CHUNK-sized
+ * pieces since extent lengths are stored as ints.
+ */
+#define HOLE_CHUNK (1 << 30)
+
+int mongo_fallocate(const char * path, int mode, off_t off, off_t len,
+    struct fuse_file_info * fi) {
+    struct inode * e = (struct inode*)fi->fh;
+    off_t end = off + len, pos, n;
+    int res;
+
+    if((res = get_cached_inode(path, e)) != 0)
+        return res;
+    if(!S_ISREG(e->mode))
+        return -ENODEV;
+    if(off < 0 || len <= 0)
+        return -EINVAL;
+
+#ifdef FALLOC_FL_PUNCH_HOLE
+    if(mode & FALLOC_FL_PUNCH_HOLE) {
+        // Like Linux, only punch holes that leave the size alone.
+        if(mode != (FALLOC_FL_PUNCH_HOLE | FALLOC_FL_KEEP_SIZE))
+            return -EOPNOTSUPP;
+        if(end > e->size)
+            end = e->size;
+        if(off >= end)
+            return 0;
+
+        if((res = flush_stage(e, off, end)) != 0)
+            return res;
+        for(pos = off; pos < end; pos += n) {
+            n = end - pos > HOLE_CHUNK ? HOLE_CHUNK : end - pos;
+            if((res = queue_empty(e, pos, n)) != 0)
+                return res;
+        }
+
+        pthread_mutex_lock(&e->wr_lock);
+        if((res = wait_blocks(e, 0)) == 0)
+            res = serialize_stored(e);
+        e->modified = time(NULL);
+        e->wr_age = e->modified;
+        pthread_mutex_unlock(&e->wr_lock);
+        return res;
+    }
+#endif
+#ifdef FALLOC_FL_KEEP_SIZE
+    if(mode & ~FALLOC_FL_KEEP_SIZE)
+        return -EOPNOTSUPP;
+    if(mode & FALLOC_FL_KEEP_SIZE)
+        return 0;
+#else
+    if(mode != 0)
+        return -EOPNOTSUPP;
+#endif
+    return update_filesize(e, end);
+}
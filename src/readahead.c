@@ -0,0 +1,136 @@
+#include <pthread.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <mongo.h>
+#include "mongo-fuse.h"
+
+/*
+ * Sequential read-ahead. Each open file tracks where its next read would
+ * land if it were being streamed front to back; once enough reads have
+ * hit that offset in a row, the next window of the file is queued for the
+ * background threads here, which fetch its blocks into the block cache.
+ */
+
+#define READAHEAD_THREADS 2
+#define READAHEAD_TRIGGER 2
+#define READAHEAD_MAX_JOBS 64
+
+struct ra_job {
+    struct ra_job * next;
+    bson_oid_t oid;
+    off_t off;
+    size_t len;
+};
+
+static pthread_mutex_t ra_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t ra_cond = PTHREAD_COND_INITIALIZER;
+static struct ra_job * ra_head = NULL, * ra_tail = NULL;
+static int ra_njobs = 0;
+static size_t ra_window = 0;
+
+static void * readahead_thread(void * arg) {
+    struct ra_job * job;
+    struct inode e;
+    int res;
+
+    for(;;) {
+        pthread_mutex_lock(&ra_lock);
+        while(!ra_head)
+            pthread_cond_wait(&ra_cond, &ra_lock);
+        job = ra_head;
+        ra_head = job->next;
+        if(!ra_head)
+            ra_tail = NULL;
+        ra_njobs--;
+        pthread_mutex_unlock(&ra_lock);
+
+        // The file may have been closed by now, so work from a copy of
+        // its id rather than the open inode.
+        init_inode(&e);
+        memcpy(&e.oid, &job->oid, sizeof(bson_oid_t));
+        if((res = prefetch_blocks(&e, job->off, job->len)) != 0)
+            fprintf(stderr, "Error reading ahead: %d\n", res);
+        free_inode(&e);
+        free(job);
+    }
+    return NULL;
+}
+
+void setup_readahead(size_t window) {
+    pthread_t thread;
+    int i;
+
+    ra_window = window;
+    for(i = 0; i < READAHEAD_THREADS; i++) {
+        if(pthread_create(&thread, NULL, readahead_thread, NULL) != 0) {
+            fprintf(stderr, "Error starting read-ahead thread\n");
+            if(i == 0)
+                ra_window = 0;
+            return;
+        }
+        pthread_detach(thread);
+    }
+}
+
+static void queue_readahead(struct inode * e, off_t off, size_t len) {
+    struct ra_job * job;
+
+    if((job = malloc(sizeof(struct ra_job))) == NULL)
+        return;
+    memcpy(&job->oid, &e->oid, sizeof(bson_oid_t));
+    job->off = off;
+    job->len = len;
+    job->next = NULL;
+
+    pthread_mutex_lock(&ra_lock);
+    // Drop the request rather than block the reader if we're behind.
+    if(ra_njobs >= READAHEAD_MAX_JOBS) {
+        pthread_mutex_unlock(&ra_lock);
+        free(job);
+        return;
+    }
+    if(ra_tail)
+        ra_tail->next = job;
+    else
+        ra_head = job;
+    ra_tail = job;
+    ra_njobs++;
+    pthread_cond_signal(&ra_cond);
+    pthread_mutex_unlock(&ra_lock);
+}
+
+void readahead_note(struct inode * e, off_t off, size_t len) {
+    off_t end = off + len, start, until;
+
+    if(ra_window == 0)
+        return;
+
+    pthread_mutex_lock(&e->wr_lock);
+    if(off == e->ra_next)
+        e->ra_hits++;
+    else {
+        e->ra_hits = 0;
+        e->ra_until = 0;
+    }
+    e->ra_next = end;
+
+    if(e->ra_hits < READAHEAD_TRIGGER ||
+        e->ra_until >= end + (off_t)ra_window / 2) {
+        pthread_mutex_unlock(&e->wr_lock);
+        return;
+    }
+
+    start = e->ra_until > end ? e->ra_until : end;
+    until = end + ra_window;
+    if(until > e->size)
+        until = e->size;
+    if(start >= until) {
+        pthread_mutex_unlock(&e->wr_lock);
+        return;
+    }
+    e->ra_until = until;
+    pthread_mutex_unlock(&e->wr_lock);
+
+    queue_readahead(e, start, until - start);
+}
@@ -2,7 +2,11 @@
 #include <mongo.h>
 #include <bson.h>
 #include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <time.h>
 #include "mongo-fuse.h"
+#include <osxfuse/fuse.h>
 
 static pthread_key_t tls_key;
 extern const char * inodes_name;
@@ -10,22 +14,75 @@ extern const char * blocks_name;
 extern mongo_host_port dbhost;
 extern mongo_write_concern write_concern;
 
+/*
+ * Connections for FUSE operations come from a bounded pool. Each operation
+ * checks one out before it does anything else and holds it until it
+ * returns, so a thread never waits for a connection while holding an
+ * inode lock that the threads holding the connections might need.
+ * Background threads (write-behind, read-ahead and so on) don't take part:
+ * there's a fixed number of them and FUSE threads wait on them, so they
+ * each keep a connection of their own as every thread used to.
+ */
+#define POOL_IDLE_CHECK 30
+#define POOL_MAX_BACKOFF 30
+
+struct pool_conn {
+    struct pool_conn * next;
+    mongo conn;
+    time_t last_used;
+};
+
 struct thread_data {
     mongo conn;
+    struct pool_conn * pooled;
+    int caller_set;
+    uid_t caller_uid;
+    gid_t caller_gid;
     int bson_id;
     // This is a buffer for compression output that should hold the
-    // largest block size plus any overhead from snappy.
+    // largest block size plus any overhead from snappy. It's sized for
+    // max_block_size when it's first used.
     // See https://code.google.com/p/snappy/source/browse/trunk/snappy.cc#55
-    char compress_buf[32 + MAX_BLOCK_SIZE + MAX_BLOCK_SIZE / 6];
-    char extent_buf[MAX_BLOCK_SIZE];
+    char * compress_buf;
+    int compress_failed;
 };
 
+static pthread_mutex_t pool_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t pool_cond = PTHREAD_COND_INITIALIZER;
+static struct pool_conn * pool_free = NULL;
+static int pool_total = 0;
+static int pool_size = 0;
+static time_t retry_at = 0;
+static int backoff = 0;
+
+static void checkin(struct pool_conn * pc) {
+    // Broken connections go back too; pool_enter reconnects them.
+    pc->last_used = time(NULL);
+    pthread_mutex_lock(&pool_lock);
+    pc->next = pool_free;
+    pool_free = pc;
+    pthread_cond_signal(&pool_cond);
+    pthread_mutex_unlock(&pool_lock);
+}
+
 void free_thread_data(void* rp) {
     struct thread_data * td = rp;
+    if(td->pooled)
+        checkin(td->pooled);
     mongo_destroy(&td->conn);
+    free(td->compress_buf);
     free(td);
 }
 
+/* Drops the calling thread's connection, e.g. before fuse_main forks. */
+void teardown_threading() {
+    struct thread_data * td = pthread_getspecific(tls_key);
+    if(td) {
+        pthread_setspecific(tls_key, NULL);
+        free_thread_data(td);
+    }
+}
+
 int get_bson_number() {
     static pthread_mutex_t mutex = PTHREAD_MUTEX_INITIALIZER;
     static int x = 0;
@@ -41,38 +98,184 @@ void setup_threading() {
     bson_set_oid_inc(get_bson_number);
 }
 
+void setup_pool(int size) {
+    pool_size = size > 0 ? size : 0;
+}
+
 static struct thread_data * get_thread_data() {
     struct thread_data * td = pthread_getspecific(tls_key);
     if(td)
         return td;
-    td = malloc(sizeof(struct thread_data));
-    memset(td, 0, sizeof(struct thread_data));
+    // Callers fail whatever they were doing with -ENOMEM, and the next
+    // call on this thread tries again.
+    if((td = calloc(1, sizeof(struct thread_data))) == NULL) {
+        fprintf(stderr, "Error allocating thread data\n");
+        return NULL;
+    }
     mongo_init(&td->conn);
     pthread_setspecific(tls_key, td);
     return td;
 }
 
-char * get_extent_buf() {
-    return get_thread_data()->extent_buf;
+char * get_compress_buf() {
+    struct thread_data * td = get_thread_data();
+    if(!td)
+        return NULL;
+    if(td->compress_buf)
+        return td->compress_buf;
+    td->compress_buf = malloc(32 + max_block_size + max_block_size / 6);
+    // Reported once per thread; later calls keep trying quietly.
+    if(!td->compress_buf && !td->compress_failed) {
+        fprintf(stderr, "Error allocating compression buffer\n");
+        td->compress_failed = 1;
+    }
+    return td->compress_buf;
 }
 
-char * get_compress_buf() {
-    return get_thread_data()->compress_buf;
+static int connect_conn(mongo * conn) {
+    if(mongo_client(conn, dbhost.host, dbhost.port) != MONGO_OK) {
+        fprintf(stderr, "Error connecting to mongodb %s:%d\n",
+            dbhost.host, dbhost.port);
+        return -EIO;
+    }
+    mongo_set_write_concern(conn, &write_concern);
+    return 0;
+}
+
+/*
+ * Reconnects a pooled connection. After a failure, nobody tries again
+ * until the backoff has passed, and the backoff doubles with each failure
+ * so a down server isn't hammered by every FUSE thread at once.
+ */
+static int reconnect_pooled(struct pool_conn * pc) {
+    time_t now = time(NULL);
+    int res;
+
+    pthread_mutex_lock(&pool_lock);
+    if(now < retry_at) {
+        pthread_mutex_unlock(&pool_lock);
+        return -EIO;
+    }
+    pthread_mutex_unlock(&pool_lock);
+
+    // mongo_destroy doesn't clear what it frees, so reinitialize right
+    // away in case connecting fails and we come through here again.
+    mongo_destroy(&pc->conn);
+    mongo_init(&pc->conn);
+    res = connect_conn(&pc->conn);
+
+    pthread_mutex_lock(&pool_lock);
+    if(res == 0)
+        backoff = 0;
+    else {
+        backoff = backoff ? backoff * 2 : 1;
+        if(backoff > POOL_MAX_BACKOFF)
+            backoff = POOL_MAX_BACKOFF;
+        retry_at = now + backoff;
+    }
+    pthread_mutex_unlock(&pool_lock);
+    return res;
+}
+
+/*
+ * Checks out a pooled connection for the rest of the current FUSE
+ * operation, waiting for one to be returned if the pool is at its limit.
+ */
+int pool_enter() {
+    struct thread_data * td;
+    struct pool_conn * pc;
+    int res;
+
+    // Fail here, before the operation starts, rather than in get_conn.
+    if((td = get_thread_data()) == NULL)
+        return -ENOMEM;
+    if(pool_size == 0 || td->pooled)
+        return 0;
+
+    pthread_mutex_lock(&pool_lock);
+    while(!pool_free && pool_total >= pool_size)
+        pthread_cond_wait(&pool_cond, &pool_lock);
+    if((pc = pool_free) != NULL)
+        pool_free = pc->next;
+    else if((pc = calloc(1, sizeof(struct pool_conn))) != NULL) {
+        mongo_init(&pc->conn);
+        pool_total++;
+    }
+    pthread_mutex_unlock(&pool_lock);
+    if(!pc)
+        return -ENOMEM;
+
+    // Connections that sat idle may have been closed by the server or a
+    // firewall, so check them before handing them out.
+    if(!mongo_is_connected(&pc->conn) ||
+        (time(NULL) - pc->last_used > POOL_IDLE_CHECK &&
+        mongo_check_connection(&pc->conn) != MONGO_OK)) {
+        if((res = reconnect_pooled(pc)) != 0) {
+            checkin(pc);
+            return res;
+        }
+    }
+    td->pooled = pc;
+    return 0;
+}
+
+void pool_leave() {
+    struct thread_data * td;
+
+    if(pool_size == 0)
+        return;
+    td = get_thread_data();
+    if(td && td->pooled) {
+        checkin(td->pooled);
+        td->pooled = NULL;
+    }
 }
 
 struct mongo * get_conn() {
     struct thread_data * td = get_thread_data();
+    if(!td)
+        return NULL;
+    if(td->pooled)
+        return &td->pooled->conn;
+
     if(mongo_is_connected(&td->conn))
         return &td->conn;
 
-    if(mongo_client(&td->conn, dbhost.host, dbhost.port) != MONGO_OK) {
-        fprintf(stderr, "Error connecting to mongodb %s:%d\n",
-            dbhost.host, dbhost.port);
+    if(connect_conn(&td->conn) != 0)
         return NULL;
-    }
+    return &td->conn;
+}
 
-    mongo_set_write_concern(&td->conn, &write_concern);
+/*
+ * The low-level API has no fuse_get_context, so its operations record who
+ * is calling here for the code shared with the path-based operations.
+ */
+int set_caller(uid_t uid, gid_t gid) {
+    struct thread_data * td = get_thread_data();
+    if(!td)
+        return -ENOMEM;
+    td->caller_uid = uid;
+    td->caller_gid = gid;
+    td->caller_set = 1;
+    return 0;
+}
 
-    return &td->conn;
+void clear_caller() {
+    struct thread_data * td = pthread_getspecific(tls_key);
+    if(td)
+        td->caller_set = 0;
 }
 
+void get_caller(uid_t * uid, gid_t * gid) {
+    struct thread_data * td = pthread_getspecific(tls_key);
+    const struct fuse_context * fcx;
+
+    if(td && td->caller_set) {
+        *uid = td->caller_uid;
+        *gid = td->caller_gid;
+        return;
+    }
+    fcx = fuse_get_context();
+    *uid = fcx->uid;
+    *gid = fcx->gid;
+}
@@ -0,0 +1,483 @@
+#include <pthread.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <time.h>
+#include <unistd.h>
+#include <mongo.h>
+#include "mongo-fuse.h"
+
+/*
+ * Write-behind for blocks. mongo_write hands each block to queue_block,
+ * which copies it onto a shared queue and returns; worker threads hash,
+ * compress and upsert it in the background, so the FUSE thread never
+ * spends time on either and consecutive writes from one file are hashed
+ * in parallel. Each inode counts its outstanding blocks under wr_lock,
+ * and anything that is about to serialize extents calls wait_blocks
+ * first so no extent ever refers to a block that hasn't been stored yet.
+ * A block's extent is already in wr_extent by the time its store fails,
+ * so a failed job is kept on the inode, data and all, until its extent
+ * has been overwritten or truncated away. serialize_stored leaves those
+ * extents in wr_extent while serializing the rest, and flush, fsync and
+ * release retry the stores through wait_blocks and report what still
+ * fails. Nothing else fails because of them.
+ *
+ * Blocks can finish hashing in any order, but a later write to the same
+ * range has to win, so each inode keeps its queued extents in the order
+ * they were written and they only go into wr_extent from the front of
+ * that list, as soon as everything before them has been hashed.
+ *
+ * Hashed blocks wait on a second queue to be stored, and workers send
+ * blocks from any number of files as one bulk insert. When that queue is
+ * short they linger briefly for more blocks to arrive, unless somebody
+ * is already waiting in wait_blocks. Workers always hash before storing,
+ * so one thread's network round trip overlaps with the others hashing.
+ */
+
+#define WRITE_BEHIND_THREADS 4
+#define WRITE_BEHIND_MAX_THREADS 16
+#define WRITE_BEHIND_BATCH_BYTES (8 << 20)
+#define WRITE_BEHIND_LINGER_MS 2
+
+struct wb_extent {
+    struct wb_extent * next;
+    off_t off;
+    size_t size;
+    int ready;
+    int empty;
+    uint8_t hash[HASH_LEN];
+};
+
+struct wb_job {
+    struct wb_job * next;
+    struct inode * e;
+    struct wb_extent * ext;
+    struct block_write block;
+    off_t off;
+    size_t size;
+    int known;
+    int error;
+    uint8_t hash[HASH_LEN];
+    char data[1];
+};
+
+static pthread_mutex_t wb_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t wb_cond = PTHREAD_COND_INITIALIZER;
+static struct wb_job * hash_head = NULL, * hash_tail = NULL;
+static struct wb_job * wb_head = NULL, * wb_tail = NULL;
+static struct timespec wb_oldest;
+static int wb_queued = 0;
+static size_t wb_queued_bytes = 0;
+static int wb_waiters = 0;
+static int wb_depth = 0;
+static int wb_batch = 1;
+
+/*
+ * Moves extents from the front of the inode's queue into wr_extent for as
+ * long as they're hashed. Must be called with wr_lock held.
+ */
+static void retire_extents(struct inode * e) {
+    struct wb_extent * x;
+    int res;
+
+    while((x = e->wb_order) != NULL && x->ready) {
+        if(x->empty)
+            res = insert_empty(&e->wr_extent, x->off, x->size);
+        else
+            res = insert_hash(&e->wr_extent, x->off, x->size, x->hash);
+        if(res != 0 && e->wb_error == 0)
+            e->wb_error = res;
+        e->wb_order = x->next;
+        if(!e->wb_order)
+            e->wb_order_tail = NULL;
+        free(x);
+    }
+}
+
+/* Must be called with wr_lock held. */
+static void append_extent(struct inode * e, struct wb_extent * x) {
+    x->next = NULL;
+    if(e->wb_order_tail)
+        e->wb_order_tail->next = x;
+    else
+        e->wb_order = x;
+    e->wb_order_tail = x;
+}
+
+static void hash_job(struct wb_job * job) {
+    struct inode * e = job->e;
+
+    hash_block(job->data, job->size, job->hash);
+    // Already stored, so there's nothing to write at all.
+    job->known = dedup_known(job->hash);
+
+    pthread_mutex_lock(&e->wr_lock);
+    memcpy(job->ext->hash, job->hash, HASH_LEN);
+    job->ext->ready = 1;
+    retire_extents(e);
+    pthread_mutex_unlock(&e->wr_lock);
+}
+
+static void finish_job(struct wb_job * job, int res) {
+    struct inode * e = job->e;
+
+    pthread_mutex_lock(&e->wr_lock);
+    if(res != 0) {
+        job->error = res;
+        job->next = e->wb_failed;
+        e->wb_failed = job;
+    }
+    e->wb_pending--;
+    pthread_cond_broadcast(&e->wb_cond);
+    pthread_mutex_unlock(&e->wr_lock);
+    if(res == 0)
+        free(job);
+}
+
+/* Must be called with wb_lock held. */
+static int batch_ready(const struct timespec * now) {
+    long waited;
+
+    if(wb_queued >= wb_batch || wb_waiters > 0 ||
+        wb_queued_bytes >= WRITE_BEHIND_BATCH_BYTES)
+        return 1;
+    waited = (now->tv_sec - wb_oldest.tv_sec) * 1000 +
+        (now->tv_nsec - wb_oldest.tv_nsec) / 1000000;
+    return waited >= WRITE_BEHIND_LINGER_MS;
+}
+
+static void * write_behind_thread(void * arg) {
+    struct wb_job * batch, * job;
+    struct block_write * blocks;
+    struct timespec now, deadline;
+    size_t bytes;
+    int n, i, res;
+
+    blocks = malloc(sizeof(struct block_write) * wb_batch);
+    if(!blocks) {
+        fprintf(stderr, "Error allocating write-behind batch\n");
+        return NULL;
+    }
+
+    pthread_mutex_lock(&wb_lock);
+    for(;;) {
+        if(hash_head) {
+            job = hash_head;
+            hash_head = job->next;
+            if(!hash_head)
+                hash_tail = NULL;
+            pthread_mutex_unlock(&wb_lock);
+
+            hash_job(job);
+
+            pthread_mutex_lock(&wb_lock);
+            if(job->known) {
+                pthread_mutex_unlock(&wb_lock);
+                finish_job(job, 0);
+                pthread_mutex_lock(&wb_lock);
+                continue;
+            }
+            job->next = NULL;
+            if(wb_tail)
+                wb_tail->next = job;
+            else {
+                wb_head = job;
+                clock_gettime(CLOCK_REALTIME, &wb_oldest);
+            }
+            wb_tail = job;
+            wb_queued++;
+            wb_queued_bytes += job->block.reallen;
+            pthread_cond_broadcast(&wb_cond);
+            continue;
+        }
+
+        if(!wb_head) {
+            pthread_cond_wait(&wb_cond, &wb_lock);
+            continue;
+        }
+        clock_gettime(CLOCK_REALTIME, &now);
+        if(!batch_ready(&now)) {
+            deadline = wb_oldest;
+            deadline.tv_nsec += WRITE_BEHIND_LINGER_MS * 1000000;
+            if(deadline.tv_nsec >= 1000000000) {
+                deadline.tv_sec++;
+                deadline.tv_nsec -= 1000000000;
+            }
+            pthread_cond_timedwait(&wb_cond, &wb_lock, &deadline);
+            continue;
+        }
+
+        batch = job = wb_head;
+        n = 1;
+        bytes = job->block.reallen;
+        while(n < wb_batch && job->next &&
+            bytes + job->next->block.reallen <= WRITE_BEHIND_BATCH_BYTES) {
+            job = job->next;
+            bytes += job->block.reallen;
+            n++;
+        }
+        wb_head = job->next;
+        job->next = NULL;
+        if(!wb_head)
+            wb_tail = NULL;
+        else
+            clock_gettime(CLOCK_REALTIME, &wb_oldest);
+        wb_queued -= n;
+        wb_queued_bytes -= bytes;
+        pthread_mutex_unlock(&wb_lock);
+
+        for(i = 0, job = batch; job; job = job->next)
+            blocks[i++] = job->block;
+        res = store_blocks(blocks, n);
+
+        while(batch) {
+            job = batch;
+            batch = job->next;
+            finish_job(job, res);
+        }
+        pthread_mutex_lock(&wb_lock);
+    }
+    return NULL;
+}
+
+void setup_write_behind(int depth, int batch) {
+    pthread_t thread;
+    long ncpu = sysconf(_SC_NPROCESSORS_ONLN);
+    int i, nthreads;
+
+    // Hashing happens on the workers too, so use every core for it.
+    nthreads = ncpu > WRITE_BEHIND_THREADS ? ncpu : WRITE_BEHIND_THREADS;
+    if(nthreads > WRITE_BEHIND_MAX_THREADS)
+        nthreads = WRITE_BEHIND_MAX_THREADS;
+
+    wb_batch = batch > 0 ? batch : 1;
+    for(i = 0; i < nthreads; i++) {
+        if(pthread_create(&thread, NULL, write_behind_thread, NULL) != 0) {
+            fprintf(stderr, "Error starting write-behind thread\n");
+            break;
+        }
+        pthread_detach(thread);
+    }
+    // Without any workers, blocks are stored synchronously.
+    if(i > 0)
+        wb_depth = depth;
+}
+
+/*
+ * Queues size bytes of buf to be stored as the block at offset. Only the
+ * reallen bytes at blk_offset are non-zero.
+ */
+int queue_block(struct inode * e, const char * buf, size_t size,
+    off_t offset, int32_t blk_offset, size_t reallen) {
+    struct wb_extent * x;
+    struct wb_job * job;
+    uint8_t hash[HASH_LEN];
+    int res = 0;
+
+    if(wb_depth == 0) {
+        struct block_write block = {
+            .hash = hash,
+            .data = buf + blk_offset,
+            .blk_offset = blk_offset,
+            .reallen = reallen,
+            .size = size
+        };
+        hash_block(buf, size, hash);
+        if(!dedup_known(hash) && (res = store_blocks(&block, 1)) != 0)
+            return res;
+        pthread_mutex_lock(&e->wr_lock);
+        res = insert_hash(&e->wr_extent, offset, size, hash);
+        pthread_mutex_unlock(&e->wr_lock);
+        return res;
+    }
+
+    // The whole block is copied, since it's hashed zeros and all.
+    job = malloc(sizeof(struct wb_job) + size);
+    x = calloc(1, sizeof(struct wb_extent));
+    if(!job || !x) {
+        free(job);
+        free(x);
+        return -ENOMEM;
+    }
+    job->next = NULL;
+    job->e = e;
+    job->ext = x;
+    job->off = offset;
+    job->size = size;
+    job->known = 0;
+    memcpy(job->data, buf, size);
+    job->block.hash = job->hash;
+    job->block.data = job->data + blk_offset;
+    job->block.blk_offset = blk_offset;
+    job->block.reallen = reallen;
+    job->block.size = size;
+    x->off = offset;
+    x->size = size;
+
+    pthread_mutex_lock(&e->wr_lock);
+    while(e->wb_pending >= wb_depth)
+        pthread_cond_wait(&e->wb_cond, &e->wr_lock);
+    e->wb_pending++;
+    append_extent(e, x);
+    pthread_mutex_unlock(&e->wr_lock);
+
+    pthread_mutex_lock(&wb_lock);
+    if(hash_tail)
+        hash_tail->next = job;
+    else
+        hash_head = job;
+    hash_tail = job;
+    pthread_cond_signal(&wb_cond);
+    pthread_mutex_unlock(&wb_lock);
+    return 0;
+}
+
+/* Records that the block at offset is all zeros, behind any queued blocks. */
+int queue_empty(struct inode * e, off_t offset, size_t size) {
+    struct wb_extent * x;
+    int res = 0;
+
+    pthread_mutex_lock(&e->wr_lock);
+    if(!e->wb_order)
+        res = insert_empty(&e->wr_extent, offset, size);
+    else if((x = calloc(1, sizeof(struct wb_extent))) == NULL)
+        res = -ENOMEM;
+    else {
+        x->off = offset;
+        x->size = size;
+        x->ready = 1;
+        x->empty = 1;
+        append_extent(e, x);
+    }
+    pthread_mutex_unlock(&e->wr_lock);
+    return res;
+}
+
+/* Frees anything left queued on an inode that's being freed. */
+void drop_queued_extents(struct inode * e) {
+    struct wb_extent * x;
+    struct wb_job * job;
+
+    while((x = e->wb_order) != NULL) {
+        e->wb_order = x->next;
+        free(x);
+    }
+    e->wb_order_tail = NULL;
+    while((job = e->wb_failed) != NULL) {
+        e->wb_failed = job->next;
+        free(job);
+    }
+}
+
+static int failed_node(const struct wb_job * job, const struct enode * n) {
+    return !n->empty && n->off < job->off + (off_t)job->size &&
+        n->off + (off_t)n->len > job->off &&
+        memcmp(n->hash, job->hash, HASH_LEN) == 0;
+}
+
+/*
+ * Forgets failed blocks that wr_extent no longer refers to. Must be
+ * called with wr_lock held.
+ */
+static void prune_failed(struct inode * e) {
+    struct wb_job ** p, * job;
+    struct etree_iter it;
+    struct enode * cur;
+
+    for(p = &e->wb_failed; (job = *p) != NULL;) {
+        for(cur = etree_first(e->wr_extent, &it, job->off,
+            job->off + job->size); cur; cur = etree_next(&it)) {
+            if(failed_node(job, cur))
+                break;
+        }
+        if(cur) {
+            p = &job->next;
+            continue;
+        }
+        *p = job->next;
+        free(job);
+    }
+}
+
+/* Must be called with wr_lock held. */
+static void retry_failed(struct inode * e) {
+    struct wb_job ** p, * job;
+    int res;
+
+    for(p = &e->wb_failed; (job = *p) != NULL;) {
+        if((res = store_blocks(&job->block, 1)) != 0) {
+            job->error = res;
+            p = &job->next;
+            continue;
+        }
+        *p = job->next;
+        free(job);
+    }
+}
+
+/*
+ * Waits for the inode's queued blocks. With report, blocks that failed to
+ * store are retried, and an error is returned if any still fail. Must be
+ * called with wr_lock held.
+ */
+int wait_blocks(struct inode * e, int report) {
+    int res;
+
+    if(e->wb_pending > 0) {
+        // Tell lingering workers not to hold our blocks back.
+        pthread_mutex_lock(&wb_lock);
+        wb_waiters++;
+        pthread_cond_broadcast(&wb_cond);
+        pthread_mutex_unlock(&wb_lock);
+
+        while(e->wb_pending > 0)
+            pthread_cond_wait(&e->wb_cond, &e->wr_lock);
+
+        pthread_mutex_lock(&wb_lock);
+        wb_waiters--;
+        pthread_mutex_unlock(&wb_lock);
+    }
+    prune_failed(e);
+    if(!report)
+        return e->wb_error;
+    retry_failed(e);
+    if(e->wb_failed)
+        return e->wb_failed->error;
+    res = e->wb_error;
+    e->wb_error = 0;
+    return res;
+}
+
+/*
+ * Serializes wr_extent, except for extents whose blocks failed to store,
+ * which stay in it until a retry stores them or they're overwritten. Must
+ * be called after wait_blocks, with wr_lock held.
+ */
+int serialize_stored(struct inode * e) {
+    struct etree * stored = NULL, * held = NULL;
+    struct etree_iter it;
+    struct enode * cur;
+    struct wb_job * job;
+    int res = 0;
+
+    if(!e->wb_failed)
+        return serialize_extent(e, e->wr_extent);
+
+    for(cur = etree_first(e->wr_extent, &it, 0, MAX_FILE_OFF);
+        cur && res == 0; cur = etree_next(&it)) {
+        for(job = e->wb_failed; job && !failed_node(job, cur);
+            job = job->next)
+            ;
+        res = insert_enode(job ? &held : &stored, cur);
+    }
+    if(res == 0)
+        res = serialize_extent(e, stored);
+    if(res == 0) {
+        free_etree(e->wr_extent);
+        e->wr_extent = held;
+        held = NULL;
+    }
+    free_etree(stored);
+    free_etree(held);
+    return res;
+}
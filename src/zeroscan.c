@@ -0,0 +1,187 @@
+#include <stdint.h>
+#include <string.h>
+#include <mongo.h>
+#include "mongo-fuse.h"
+
+/*
+ * Zero detection for the write path. Blocks are trimmed of leading and
+ * trailing zeros before they're hashed and stored, and long runs of
+ * zeros inside a block are split out as holes, so sparse files don't
+ * cost anything for the parts that are empty.
+ *
+ * The scans are done with the widest vectors the CPU has: AVX-512 or AVX2
+ * where available, checked once at startup, then SSE2 on any x86-64, and
+ * a word at a time everywhere else.
+ */
+
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#define ZEROSCAN_X86
+#include <immintrin.h>
+#endif
+
+static size_t first_nonzero_word(const char * buf, size_t len);
+static size_t last_nonzero_word(const char * buf, size_t len);
+
+static size_t (*first_nonzero)(const char * buf, size_t len) =
+    first_nonzero_word;
+static size_t (*last_nonzero)(const char * buf, size_t len) =
+    last_nonzero_word;
+
+/* Returns the offset of the first non-zero byte, or len if there isn't one. */
+static size_t first_nonzero_word(const char * buf, size_t len) {
+    size_t i = 0;
+    uint64_t w;
+
+    for(; i + sizeof(w) <= len; i += sizeof(w)) {
+        memcpy(&w, buf + i, sizeof(w));
+        if(w != 0)
+            break;
+    }
+    for(; i < len && buf[i] == 0; i++);
+    return i;
+}
+
+/* Returns the offset after the last non-zero byte, or 0 if there isn't one. */
+static size_t last_nonzero_word(const char * buf, size_t len) {
+    size_t i = len;
+    uint64_t w;
+
+    for(; i >= sizeof(w); i -= sizeof(w)) {
+        memcpy(&w, buf + i - sizeof(w), sizeof(w));
+        if(w != 0)
+            break;
+    }
+    for(; i > 0 && buf[i - 1] == 0; i--);
+    return i;
+}
+
+#ifdef ZEROSCAN_X86
+// Each vector loop stops at the first vector with anything non-zero in it
+// and leaves finding the byte to the word scan.
+
+static size_t first_nonzero_sse2(const char * buf, size_t len) {
+    __m128i zero = _mm_setzero_si128();
+    size_t i = 0;
+
+    for(; i + 16 <= len; i += 16) {
+        __m128i x = _mm_loadu_si128((const __m128i*)(buf + i));
+        if(_mm_movemask_epi8(_mm_cmpeq_epi8(x, zero)) != 0xffff)
+            break;
+    }
+    return i + first_nonzero_word(buf + i, len - i);
+}
+
+static size_t last_nonzero_sse2(const char * buf, size_t len) {
+    __m128i zero = _mm_setzero_si128();
+    size_t i = len;
+
+    for(; i >= 16; i -= 16) {
+        __m128i x = _mm_loadu_si128((const __m128i*)(buf + i - 16));
+        if(_mm_movemask_epi8(_mm_cmpeq_epi8(x, zero)) != 0xffff)
+            break;
+    }
+    return last_nonzero_word(buf, i);
+}
+
+__attribute__((target("avx2")))
+static size_t first_nonzero_avx2(const char * buf, size_t len) {
+    size_t i = 0;
+
+    for(; i + 32 <= len; i += 32) {
+        __m256i x = _mm256_loadu_si256((const __m256i*)(buf + i));
+        if(!_mm256_testz_si256(x, x))
+            break;
+    }
+    return i + first_nonzero_word(buf + i, len - i);
+}
+
+__attribute__((target("avx2")))
+static size_t last_nonzero_avx2(const char * buf, size_t len) {
+    size_t i = len;
+
+    for(; i >= 32; i -= 32) {
+        __m256i x = _mm256_loadu_si256((const __m256i*)(buf + i - 32));
+        if(!_mm256_testz_si256(x, x))
+            break;
+    }
+    return last_nonzero_word(buf, i);
+}
+
+__attribute__((target("avx512f,avx512bw")))
+static size_t first_nonzero_avx512(const char * buf, size_t len) {
+    size_t i = 0;
+
+    for(; i + 64 <= len; i += 64) {
+        __m512i x = _mm512_loadu_si512((const void*)(buf + i));
+        if(_mm512_test_epi8_mask(x, x) != 0)
+            break;
+    }
+    return i + first_nonzero_word(buf + i, len - i);
+}
+
+__attribute__((target("avx512f,avx512bw")))
+static size_t last_nonzero_avx512(const char * buf, size_t len) {
+    size_t i = len;
+
+    for(; i >= 64; i -= 64) {
+        __m512i x = _mm512_loadu_si512((const void*)(buf + i - 64));
+        if(_mm512_test_epi8_mask(x, x) != 0)
+            break;
+    }
+    return last_nonzero_word(buf, i);
+}
+#endif
+
+void setup_zeroscan() {
+#ifdef ZEROSCAN_X86
+    __builtin_cpu_init();
+    if(__builtin_cpu_supports("avx512bw")) {
+        first_nonzero = first_nonzero_avx512;
+        last_nonzero = last_nonzero_avx512;
+    } else if(__builtin_cpu_supports("avx2")) {
+        first_nonzero = first_nonzero_avx2;
+        last_nonzero = last_nonzero_avx2;
+    } else if(__builtin_cpu_supports("sse2")) {
+        first_nonzero = first_nonzero_sse2;
+        last_nonzero = last_nonzero_sse2;
+    }
+#endif
+}
+
+/*
+ * Finds where the non-zero bytes of buf start and end. Sets *start to the
+ * offset of the first and returns the offset after the last, or 0 if buf
+ * is all zeros.
+ */
+size_t trim_zeros(const char * buf, size_t len, size_t * start) {
+    size_t end;
+
+    if((end = last_nonzero(buf, len)) == 0) {
+        *start = 0;
+        return 0;
+    }
+    *start = first_nonzero(buf, end);
+    return end;
+}
+
+/*
+ * Finds the first run of zeros in buf that covers at least one whole
+ * ZERO_RUN_MIN-byte chunk of it. Returns 1 and sets *start and *runlen to
+ * the whole run, or returns 0 if there isn't one.
+ */
+int find_zero_run(const char * buf, size_t len,
+    size_t * start, size_t * runlen) {
+    size_t chunk, end;
+
+    for(chunk = 0; chunk + ZERO_RUN_MIN <= len; chunk += ZERO_RUN_MIN) {
+        if(first_nonzero(buf + chunk, ZERO_RUN_MIN) < ZERO_RUN_MIN)
+            continue;
+
+        *start = last_nonzero(buf, chunk);
+        end = chunk + ZERO_RUN_MIN;
+        end += first_nonzero(buf + end, len - end);
+        *runlen = end - *start;
+        return 1;
+    }
+    return 0;
+}
@@ -0,0 +1,119 @@
+// write-behind-test.c
+
+/**
+  Checks that a block whose store fails is retried by every flush, which
+  fails until the retry works or the block is overwritten, and that
+  nothing but flushes sees the failure.
+
+  cd test && cc -Wall -DMONGO_HAVE_STDINT -I../src write-behind-test.c \
+    ../src/write-behind.c ../src/extents.c ../src/compact.c \
+    -lmongoc -lpthread -o write-behind-test && ./write-behind-test
+ */
+
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <mongo.h>
+#include "mongo-fuse.h"
+
+char * extents_name = "test.extents";
+char * dbname = "test";
+size_t max_block_size = 65536;
+int hash_len = 20;
+
+static pthread_mutex_t fail_lock = PTHREAD_MUTEX_INITIALIZER;
+static int fail_stores = 0;
+static int stores = 0;
+
+void hash_block(const char * buf, size_t size, uint8_t hash[HASH_LEN]) {
+    memset(hash, 0, HASH_LEN);
+    memcpy(hash, buf, size < HASH_LEN ? size : HASH_LEN);
+}
+
+int dedup_known(const uint8_t hash[HASH_LEN]) {
+    return 0;
+}
+
+int store_blocks(const struct block_write * blocks, int count) {
+    int res;
+    pthread_mutex_lock(&fail_lock);
+    res = fail_stores ? -EIO : 0;
+    stores++;
+    pthread_mutex_unlock(&fail_lock);
+    return res;
+}
+
+mongo * get_conn() {
+    return NULL;
+}
+
+static void set_failing(int fail) {
+    pthread_mutex_lock(&fail_lock);
+    fail_stores = fail;
+    pthread_mutex_unlock(&fail_lock);
+}
+
+/* What mongo_flush does before it serializes anything. */
+static int flush(struct inode * e) {
+    int res;
+    pthread_mutex_lock(&e->wr_lock);
+    res = wait_blocks(e, 1);
+    pthread_mutex_unlock(&e->wr_lock);
+    return res;
+}
+
+static int write_at(struct inode * e, char c, off_t off) {
+    char buf[4096];
+    memset(buf, c, sizeof(buf));
+    return queue_block(e, buf, sizeof(buf), off, 0, sizeof(buf));
+}
+
+#define CHECK(cond, msg) do { \
+    if(!(cond)) { \
+        fprintf(stderr, "FAIL: %s\n", msg); \
+        return 1; \
+    } \
+} while(0)
+
+int main() {
+    struct inode e;
+
+    memset(&e, 0, sizeof(e));
+    pthread_mutex_init(&e.wr_lock, NULL);
+    pthread_cond_init(&e.wb_cond, NULL);
+    setup_write_behind(8, 1);
+
+    CHECK(write_at(&e, 'a', 0) == 0, "queueing a block");
+    CHECK(flush(&e) == 0, "flush after a good store");
+
+    set_failing(1);
+    CHECK(write_at(&e, 'b', 4096) == 0, "queueing a block");
+    CHECK(flush(&e) != 0, "flush after a failed store");
+    pthread_mutex_lock(&e.wr_lock);
+    CHECK(wait_blocks(&e, 0) == 0, "waiting without reporting");
+    pthread_mutex_unlock(&e.wr_lock);
+    CHECK(flush(&e) != 0, "second flush while stores fail");
+    set_failing(0);
+    CHECK(flush(&e) == 0, "flush once the retried store works");
+    CHECK(flush(&e) == 0, "flush with nothing left to retry");
+
+    set_failing(1);
+    CHECK(write_at(&e, 'c', 8192) == 0, "queueing a block");
+    CHECK(flush(&e) != 0, "flush after a failed store");
+    set_failing(0);
+    pthread_mutex_lock(&fail_lock);
+    stores = 0;
+    pthread_mutex_unlock(&fail_lock);
+    CHECK(write_at(&e, 'd', 8192) == 0, "queueing a block");
+    CHECK(flush(&e) == 0, "flush once the failed block is overwritten");
+    pthread_mutex_lock(&fail_lock);
+    CHECK(stores == 1, "the overwritten block isn't retried");
+    pthread_mutex_unlock(&fail_lock);
+
+    drop_queued_extents(&e);
+    free_etree(e.wr_extent);
+    printf("ok\n");
+    return 0;
+}